@@ -34,7 +34,10 @@ unset(CMAKE_REQUIRED_FLAGS)
 
 function(embed_ir_as_header target_name source_file)
     # Parse additional arguments for include directories
-    set(options "")
+    # DEBUG_INFO keeps line tables in the IR so profilers can attribute JIT'd code to source lines
+    # EMBED_SOURCE also embeds the preprocessed source, for RuFuS::instantiate()
+    # PORTABLE builds for the baseline x86-64 instead of ${X86_64_LEVEL}, leaving ISA choices to the runtime host
+    set(options DEBUG_INFO EMBED_SOURCE PORTABLE)
     set(oneValueArgs "")
     set(multiValueArgs INCLUDES DEFINITIONS)
     cmake_parse_arguments(ARG "${options}" "${oneValueArgs}" "${multiValueArgs}" ${ARGN})
@@ -60,11 +63,21 @@ function(embed_ir_as_header target_name source_file)
         list(APPEND COMPILE_FLAGS -I${dir})
     endforeach()
 
+    if(ARG_DEBUG_INFO)
+        list(APPEND COMPILE_FLAGS -gline-tables-only)
+    endif()
+
+    if(ARG_PORTABLE)
+        set(TARGET_FLAGS -march=x86-64 -mtune=generic)
+    else()
+        set(TARGET_FLAGS -march=${X86_64_LEVEL})
+    endif()
+
     # Generate IR
     add_custom_command(
         OUTPUT ${IR_FILE}
         COMMAND ${RUFUS_CLANG_EXECUTABLE} ${COMPILE_FLAGS}
-            -S -emit-llvm -O0 -march=${X86_64_LEVEL}
+            -S -emit-llvm -O0 ${TARGET_FLAGS}
             -fno-discard-value-names
             -DNDEBUG
             ${CMAKE_CURRENT_SOURCE_DIR}/${source_file}
@@ -73,6 +86,33 @@ function(embed_ir_as_header target_name source_file)
         VERBATIM
     )
 
+    # Preprocess, since the headers won't be around at runtime
+    set(EMBED_SOURCE_ARGS "")
+    set(SOURCE_FILE "")
+    if(ARG_EMBED_SOURCE)
+        set(SOURCE_FILE ${CMAKE_CURRENT_BINARY_DIR}/${target_name}.ii)
+        add_custom_command(
+            OUTPUT ${SOURCE_FILE}
+            COMMAND ${RUFUS_CLANG_EXECUTABLE} ${COMPILE_FLAGS}
+                -E -DNDEBUG ${TARGET_FLAGS}
+                ${CMAKE_CURRENT_SOURCE_DIR}/${source_file}
+                -o ${SOURCE_FILE}
+            DEPENDS ${source_file}
+            VERBATIM
+        )
+
+        # Same target as the IR, so instantiations see the same ISA macros
+        set(SOURCE_FLAGS -std=c++${CXX_STD} ${TARGET_FLAGS})
+        if(ARG_DEBUG_INFO)
+            list(APPEND SOURCE_FLAGS -gline-tables-only)
+        endif()
+        string(REPLACE ";" " " SOURCE_FLAGS "${SOURCE_FLAGS}")
+        set(EMBED_SOURCE_ARGS
+            -DSOURCE_FILE=${SOURCE_FILE}
+            -DSOURCE_VAR_NAME=${target_name}_source
+            -DSOURCE_FLAGS=${SOURCE_FLAGS})
+    endif()
+
     # Convert to header
     add_custom_command(
         OUTPUT ${HEADER_FILE}
@@ -80,8 +120,9 @@ function(embed_ir_as_header target_name source_file)
             -DIR_FILE=${IR_FILE}
             -DHEADER_FILE=${HEADER_FILE}
             -DVAR_NAME=${target_name}_ir
+            ${EMBED_SOURCE_ARGS}
             -P ${RUFUS_CMAKE_DIR}/embed_ir.cmake
-        DEPENDS ${IR_FILE}
+        DEPENDS ${IR_FILE} ${SOURCE_FILE}
         VERBATIM
     )
 
@@ -7,3 +7,22 @@ ${IR_CONTENT}
 )IR_DELIM\";
 }
 ")
+
+if(SOURCE_FILE)
+  file(READ ${SOURCE_FILE} SOURCE_CONTENT)
+  separate_arguments(SOURCE_FLAGS UNIX_COMMAND "${SOURCE_FLAGS}")
+  list(TRANSFORM SOURCE_FLAGS PREPEND "\"")
+  list(TRANSFORM SOURCE_FLAGS APPEND "\"")
+  list(JOIN SOURCE_FLAGS ", " SOURCE_FLAGS)
+  file(APPEND ${HEADER_FILE}
+"
+#include <string>
+#include <vector>
+namespace rufus::embedded {
+constexpr const char* ${SOURCE_VAR_NAME} = R\"SOURCE_DELIM(
+${SOURCE_CONTENT}
+)SOURCE_DELIM\";
+inline const std::vector<std::string> ${SOURCE_VAR_NAME}_flags{${SOURCE_FLAGS}};
+}
+")
+endif()
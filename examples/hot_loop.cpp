@@ -23,6 +23,20 @@ void hot_loop(std::vector<float> &arr) {
         data[i] = data[i] * 2.0f;
 }
 
+// Sizes and strides as members, as in most config structs and functors
+struct Grid {
+    float *data;
+    int n;
+    int stride;
+
+    int size() const { return n; }
+};
+
+void scale_grid(const Grid &grid, float factor) {
+    for (int i = 0; i < grid.size(); ++i)
+        grid.data[i * grid.stride] *= factor;
+}
+
 template <typename T>
 void hot_loop_template(T *arr, int N) {
     arr = (T *)__builtin_assume_aligned(arr, 64);
@@ -86,6 +100,14 @@ void evaluate_all_pairs_inv_r2_lambda(float *__restrict__ rs, float *__restrict_
     });
 }
 
+float inv_r2(float *__restrict__ rs, float *__restrict__ rt) { return InvR2Evaluator{}(rs, rt); }
+
+// Generic driver: the evaluator is only known at runtime, so it's an indirect call until specialized
+void evaluate_all_pairs_fnptr(float *__restrict__ rs, float *__restrict__ rt, float *__restrict__ u, int Nsrc,
+                              int Ntrg, float (*eval)(float *, float *)) {
+    evaluate_all_pairs(rs, rt, u, Nsrc, Ntrg, eval);
+}
+
 template <typename Real>
 Real eval_horner(Real *coefs, int N, Real x) {
     Real result = 0.0;
@@ -2,6 +2,8 @@
 #include <rufus.hpp>
 
 #include <array>
+#include <cmath>
+#include <cstddef>
 #include <iostream>
 #include <vector>
 
@@ -34,6 +36,173 @@ void std_vector_example(RuFuS &RS, int N) {
         std::cout << "Test (std::vector) passed for N=" << N << "\n";
 }
 
+void constraint_example(RuFuS &RS) {
+    // One variant for every N that is a multiple of 16 up to 1024, so the vectorizer can drop the remainder loop. Any
+    // other N still works, through the unconstrained variant.
+    const auto spec = RuFuS::Specialization{.constraints = {{"N", {.min = 16, .max = 1024, .multiple_of = 16}}}};
+    auto hot_loop_jit = RS.compile<void (*)(float *, int)>("hot_loop(float*,int)", spec);
+
+    alignas(64) std::array<float, 1024> arr;
+    for (int N : {64, 512, 65}) {
+        arr.fill(1.0f);
+        hot_loop_jit(arr.data(), N);
+        if (arr[0] != 2.0f || arr[N - 1] != 2.0f)
+            std::cerr << "Test (constraint) failed for N=" << N << "\n";
+        else
+            std::cout << "Test (constraint) passed for N=" << N << "\n";
+    }
+}
+
+// Same layout as in hot_loop.cpp
+struct Grid {
+    float *data;
+    int n;
+    int stride;
+};
+
+void field_example(RuFuS &RS) {
+    // Pins grid.n and grid.stride, so the loop has a constant trip count and unit stride. Grids of any other shape
+    // still work, through the variant without field values.
+    const auto spec = RuFuS::Specialization{.field_values = {{"grid", offsetof(Grid, n), 256},
+                                                             {"grid", offsetof(Grid, stride), 1}}};
+    auto scale_grid_jit = RS.compile<void (*)(const Grid &, float)>("scale_grid(Grid const&,float)", spec);
+
+    alignas(64) std::array<float, 512> arr;
+    for (Grid grid : {Grid{arr.data(), 256, 1}, Grid{arr.data(), 100, 2}}) {
+        arr.fill(1.0f);
+        scale_grid_jit(grid, 2.0f);
+        const int last = (grid.n - 1) * grid.stride;
+        if (arr[0] != 2.0f || arr[last] != 2.0f || (grid.stride > 1 && arr[1] != 1.0f))
+            std::cerr << "Test (field) failed for n=" << grid.n << "\n";
+        else
+            std::cout << "Test (field) passed for n=" << grid.n << "\n";
+    }
+}
+
+void polynomial_example(const std::vector<float> &coeffs) {
+    // Rebalancing changes the rounding order, so it gets its own instance and is compared within a tolerance
+    RuFuS RE;
+    RE.load_ir_string(rufus::embedded::hot_loop_ir).enable_polynomial_rebalancing();
+    const int N = coeffs.size();
+    auto eval_jit = RE.compile<float (*)(float *, float)>("float eval_horner<float>(float*,int,float)", {{"N", N}});
+
+    std::vector<float> coefs = coeffs;
+    for (float x : {-1.0f, -0.3f, 0.0f, 0.7f, 1.0f}) {
+        float expected = 0.0f;
+        for (int i = N - 1; i >= 0; --i)
+            expected = std::fma(expected, x, coefs[i]);
+
+        const float result = eval_jit(coefs.data(), x);
+        if (std::abs(result - expected) > 1e-6f + 1e-5f * std::abs(expected))
+            std::cerr << "Test (polynomial) failed for x=" << x << ": " << result << " != " << expected << "\n";
+        else
+            std::cout << "Test (polynomial) passed for x=" << x << "\n";
+    }
+}
+
+void instantiation_example(RuFuS &RS, int N) {
+    // hot_loop.cpp only instantiates hot_loop_template for float and double. Other types are instantiated from the
+    // embedded source when RuFuS is built with RUFUS_ENABLE_CLANG.
+#ifndef RUFUS_HAS_CLANG
+    std::cout << "Test (instantiation) skipped, no in-process clang\n";
+#else
+    const std::string func_str = "void hot_loop_template<int>(int*,int)";
+    RS.load_source_string(rufus::embedded::hot_loop_source, rufus::embedded::hot_loop_source_flags)
+        .instantiate(func_str);
+    auto hot_loop_jit = RS.compile<void (*)(int *)>(func_str, {{"N", N}});
+    if (!hot_loop_jit) {
+        std::cerr << "Test (instantiation) failed for N=" << N << "\n";
+        return;
+    }
+
+    alignas(64) std::array<int, 1024> arr;
+    arr.fill(1);
+    hot_loop_jit(arr.data());
+    if (arr[0] != 2 || arr[N - 1] != 2)
+        std::cerr << "Test (instantiation) failed for N=" << N << "\n";
+    else
+        std::cout << "Test (instantiation) passed for N=" << N << "\n";
+#endif
+}
+
+void soa_example(RuFuS &RS) {
+    constexpr int Nsrc = 64, Ntrg = 256;
+    const std::string func_str = "evaluate_all_pairs_inv_r2_struct(float*,float*,float*,int,int)";
+    const auto spec = RuFuS::Specialization{.const_args = {{"Nsrc", Nsrc}, {"Ntrg", Ntrg}}};
+
+    // Sources and targets are xyz points, read by the kernel one coordinate array at a time
+    using FuncType = void (*)(float *, float *, float *);
+    auto aos = RS.compile<FuncType>(func_str, spec);
+    auto soa = RS.compile_soa<FuncType>(func_str, spec,
+                                        {{"rs", {.count_arg = "Nsrc", .fields = 3, .element_size = sizeof(float)}},
+                                         {"rt", {.count_arg = "Ntrg", .fields = 3, .element_size = sizeof(float)}}});
+    if (!soa) {
+        std::cerr << "Test (soa) failed to compile\n";
+        return;
+    }
+
+    std::vector<float> rs(3 * Nsrc), rt(3 * Ntrg), u_aos(Ntrg, 0.0f), u_soa(Ntrg, 0.0f);
+    for (int i = 0; i < 3 * Nsrc; ++i)
+        rs[i] = 1.0f + i;
+    for (int i = 0; i < 3 * Ntrg; ++i)
+        rt[i] = -0.1f * i;
+
+    aos(rs.data(), rt.data(), u_aos.data());
+    soa(rs.data(), rt.data(), u_soa.data());
+
+    if (u_aos != u_soa)
+        std::cerr << "Test (soa) failed for Ntrg=" << Ntrg << "\n";
+    else
+        std::cout << "Test (soa) passed for Ntrg=" << Ntrg << "\n";
+}
+
+void pipeline_example(RuFuS &RS) {
+    // Two passes over arr become one loop: arr * 2 * 2
+    constexpr int N = 512;
+    const auto spec = RuFuS::Specialization{.const_args = {{"N", N}}};
+    auto fused = RS.compile_pipeline<void (*)(float *)>(
+        "doubled_twice", {{.function = "hot_loop(float*,int)", .spec = spec},
+                          {.function = "void hot_loop_template<float>(float*,int)", .spec = spec}});
+
+    alignas(64) std::array<float, N> arr;
+    arr.fill(1.0f);
+    fused(arr.data());
+    if (arr[0] != 4.0f || arr[N - 1] != 4.0f)
+        std::cerr << "Test (pipeline) failed for N=" << N << "\n";
+    else
+        std::cout << "Test (pipeline) passed for N=" << N << "\n";
+}
+
+void parallel_example(RuFuS &RS) {
+    constexpr int Nsrc = 64, Ntrg = 1000;
+    const std::string func_str = "evaluate_all_pairs_inv_r2_struct(float*,float*,float*,int,int)";
+    const auto spec = RuFuS::Specialization{.const_args = {{"Nsrc", Nsrc}, {"Ntrg", Ntrg}}};
+
+    // Targets are split across the thread pool, each chunk getting its own slice of rt and u
+    using FuncType = void (*)(float *, float *, float *);
+    auto serial = RS.compile<FuncType>(func_str, spec);
+    auto parallel = RS.compile_parallel<FuncType>(
+        func_str, spec, {.count_arg = "Ntrg", .strides = {{"rt", 3 * sizeof(float)}, {"u", sizeof(float)}}});
+
+    std::vector<float> rs(3 * Nsrc), rt(3 * Ntrg), u_serial(Ntrg, 0.0f), u_parallel(Ntrg, 0.0f);
+    for (int i = 0; i < 3 * Nsrc; ++i)
+        rs[i] = 1.0f + i;
+    for (int i = 0; i < 3 * Ntrg; ++i)
+        rt[i] = -0.1f * i;
+
+    serial(rs.data(), rt.data(), u_serial.data());
+    parallel(rs.data(), rt.data(), u_parallel.data());
+
+    // Chunks are specialized, and so vectorized, differently from the serial variant
+    bool close = true;
+    for (int i = 0; i < Ntrg; ++i)
+        close = close && std::abs(u_parallel[i] - u_serial[i]) <= 1e-5f * std::abs(u_serial[i]);
+    if (!close)
+        std::cerr << "Test (parallel) failed for Ntrg=" << Ntrg << "\n";
+    else
+        std::cout << "Test (parallel) passed for Ntrg=" << Ntrg << "\n";
+}
+
 int main(int argc, char **argv) {
     RuFuS RS;
 
@@ -60,9 +229,21 @@ int main(int argc, char **argv) {
                            {{"Nsrc", 64}, {"Ntrg", 64}})
         .optimize();
 
+    // Function pointer arguments can be bound to a function in the IR, turning the indirect calls into direct ones
+    RS.specialize_function("evaluate_all_pairs_fnptr(float*,float*,float*,int,int,float(*)(float*,float*))",
+                           RuFuS::Specialization{.const_args = {{"Nsrc", 64}, {"Ntrg", 64}},
+                                                 .function_args = {{"eval", "inv_r2(float*,float*)"}}})
+        .optimize();
+
     // C++ types are a bit more annoying due to the need to fully specify the types
     // ...so we do them separately
     std_vector_example(RS, 64);
+    parallel_example(RS);
+    constraint_example(RS);
+    field_example(RS);
+    pipeline_example(RS);
+    soa_example(RS);
+    instantiation_example(RS, 64);
 
     std::vector<float> coeffs{
         1.340418974956820e-03,  -6.599369969180820e-03, 1.490307518448090e-02, -2.093949273676980e-02,
@@ -73,6 +254,7 @@ int main(int argc, char **argv) {
     RS.specialize_function("evaluate_all_pairs_laplace_polynomial(float*,float*,float*,int,int,float*,int)",
                            {{"Nsrc", 64}, {"Ntrg", 64}, {"n_coefs", coeffs.size()}})
         .optimize();
+    polynomial_example(coeffs);
 
     // Prints out things like available functions and their signatures
     RS.print_debug_info();
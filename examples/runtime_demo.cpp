@@ -0,0 +1,28 @@
+#include <rufus_runtime.hpp>
+
+#include <array>
+#include <iostream>
+
+// Loads a kernel the JIT already compiled, without linking LLVM. Populate the cache first with
+// `RUFUS_CACHE_DIR=<dir> ./demo`.
+int main(int argc, char **argv) {
+    RuFuSRuntime runtime(argc > 1 ? argv[1] : "");
+
+    constexpr int N = 64;
+    auto hot_loop = runtime.load<void (*)(float *)>("hot_loop(float*,int)", {{"N", N}});
+    if (!hot_loop) {
+        std::cerr << "hot_loop(float*,int) with N=" << N << " is not in the cache\n";
+        return 1;
+    }
+
+    alignas(64) std::array<float, N> testarr;
+    testarr.fill(1.0f);
+    hot_loop(testarr.data());
+
+    if (testarr[0] != 2.0f || testarr[N - 1] != 2.0f)
+        std::cerr << "Test (runtime) failed for N=" << N << "\n";
+    else
+        std::cout << "Test (runtime) passed for N=" << N << "\n";
+
+    return 0;
+}
@@ -1,10 +1,13 @@
 #ifndef RUFUS_HPP
 #define RUFUS_HPP
 
+#include <cstddef>
 #include <cstdint>
 #include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 class RuFuS {
   private:
@@ -12,7 +15,106 @@ class RuFuS {
     std::unique_ptr<Impl> impl;
 
   public:
+    // Facts about an integer argument that hold for a whole class of values, e.g. `N % 16 == 0` or `64 <= N <= 256`.
+    // Bounds are inclusive and compared as signed.
+    struct Constraint {
+        std::optional<std::int64_t> min;
+        std::optional<std::int64_t> max;
+        std::int64_t multiple_of = 0; // 0 or 1 for no divisibility fact
+    };
+
+    // Pins the integer `offset` bytes into the object a reference argument or `this` refers to, e.g. a size or stride
+    // member of a config struct. The field is read on entry, so plain pointers, which may be null, aren't accepted. It
+    // must not change during the call.
+    struct FieldValue {
+        std::string arg;
+        std::size_t offset = 0;
+        std::int64_t value = 0;
+    };
+
+    // Everything that defines one specialized variant of a function. `const_args` pins integer arguments (or named
+    // local variables) to values. `function_args` binds function-pointer arguments to a function in the loaded IR,
+    // given by its demangled name, so calls through them become direct and can be inlined; the function must have the
+    // signature the calls use. Only raw function pointers can be bound: std::function and other type-erased callables
+    // call through an invoker stored in the object, which stays indirect. `constraints` keep an
+    // argument but let the optimizer assume facts about it (dropping remainder loops and checks), so one variant
+    // covers every value satisfying them; calls that don't are forwarded to the variant without constraints.
+    // `field_values` do the same for object state (offsets as from offsetof()): loads of the field become constants,
+    // and calls where it holds something else go to the variant without field values.
+    struct Specialization {
+        std::map<std::string, int> const_args;
+        std::map<std::string, std::string> function_args;
+        std::map<std::string, Constraint> constraints;
+        std::vector<FieldValue> field_values;
+    };
+
+    // What to produce for external profilers. The perf map (/tmp/perf-<pid>.map) is enough for `perf report` to name
+    // JIT'd symbols; jitdump records additionally carry the code itself, source lines and unwind info, which
+    // `perf inject --jit` needs for `perf annotate` and call stacks. Specialized symbols carry their const args in
+    // their name, e.g. `hot_loop_N_64_<hash>`.
+    struct ProfilingOptions {
+        bool perf_map = true;
+        bool jitdump = true;
+        bool debug_info = true;
+        bool unwind_info = true;
+    };
+
+    // Splits the index range of one argument, e.g. a target count, across a thread pool owned by RuFuS (sized by
+    // RUFUS_THREADS). `strides` gives the bytes one index step advances each pointer argument that walks the range;
+    // other arguments reach every chunk unchanged, so chunks must write disjoint memory. When the count is one of the
+    // specialization's const args, chunks are specialized to the grain as well. Constraints on the count describe the
+    // whole range, so chunks don't get them.
+    struct ParallelRange {
+        std::string count_arg;
+        std::map<std::string, std::size_t> strides;
+        std::int64_t grain = 0; // indices per chunk, 0 to pick one from the trip count and the pool size
+    };
+
+    // One step of a pipeline, see compile_pipeline(). `bindings` renames stage arguments to driver arguments; by
+    // default a stage argument is the driver argument of the same name.
+    struct Stage {
+        std::string function;
+        Specialization spec;
+        std::map<std::string, std::string> bindings;
+    };
+
+    // Record layout of a pointer argument for compile_soa(): `count_arg` (an argument or const arg) records of `fields`
+    // elements of `element_size` bytes, e.g. {"Nsrc", 3, sizeof(float)} for xyz points. With `write_back`, what the
+    // kernel writes is copied back into the caller's records; it is required for arguments the kernel writes to.
+    struct Layout {
+        std::string count_arg;
+        std::size_t fields = 0;
+        std::size_t element_size = 0;
+        bool write_back = false;
+    };
+
+    // How full the JIT's memory slabs are, in bytes, and how much of them the kernel actually backs by huge pages
+    // (from /proc/self/smaps). All zero unless huge pages are enabled.
+    struct MemoryStats {
+        std::size_t code_mapped = 0;
+        std::size_t code_used = 0;
+        std::size_t code_huge = 0;
+        std::size_t read_only_mapped = 0;
+        std::size_t read_only_used = 0;
+        std::size_t read_only_huge = 0;
+        std::size_t data_mapped = 0;
+        std::size_t data_used = 0;
+        std::size_t data_huge = 0;
+    };
+
+    // Calls of an instrumented specialization, and the cycle counter ticks (rdtsc on x86) spent in them
+    struct KernelStats {
+        std::uint64_t calls = 0;
+        std::uint64_t cycles = 0;
+    };
+
+    // Where compiled code lives. A private engine belongs to this instance. The shared engine is one JIT and target
+    // setup for the whole process; each instance attached to it still gets its own symbol namespace, so libraries can
+    // each keep their own RuFuS without paying for the setup again. Either way it is created on first use.
+    enum class Engine { Private, Shared };
+
     RuFuS();
+    explicit RuFuS(Engine engine);
     ~RuFuS();
 
     // Move constructor/assignment (needed for unique_ptr)
@@ -25,25 +127,117 @@ class RuFuS {
 
     RuFuS &load_ir_file(const std::string &ir_file);
     RuFuS &load_ir_string(const std::string &ir_source);
+
+    // Source for instantiate(), e.g. rufus::embedded::<target>_source and <target>_source_flags from
+    // embed_ir_as_header(... EMBED_SOURCE). `flags` are clang driver flags; without a -march, -march=native is used.
+    RuFuS &load_source_string(const std::string &source, const std::vector<std::string> &flags = {});
+
+    // Instantiates a template from the loaded source on demand, e.g. "void hot_loop_template<int>(int*,int)", so it
+    // can be specialized and compiled under that name like anything in the loaded IR. Needs RuFuS built with
+    // RUFUS_ENABLE_CLANG.
+    RuFuS &instantiate(const std::string &declaration);
+
     RuFuS &specialize_function(const std::string &demangled_name, const std::map<std::string, int> &const_args);
+    RuFuS &specialize_function(const std::string &demangled_name, const Specialization &spec);
     RuFuS &optimize();
 
+    // compile() returns a stub right away. Optimization and codegen of the function run when the stub is first
+    // called, and optimize() leaves that work to the stubs. Also enabled by RUFUS_LAZY.
+    RuFuS &enable_lazy_compilation();
+
+    // Share compiled objects with the other processes on the node through `cache_dir` (also RUFUS_CACHE_DIR). Each
+    // specialization is compiled by whichever process gets to it first; the others wait on a file lock and load the
+    // result. Objects are self-contained and don't run static initializers. RuFuSRuntime (rufus_runtime.hpp) loads them
+    // without LLVM.
+    RuFuS &enable_shared_cache(const std::string &cache_dir);
+
+    // Rewrites fully unrolled Horner chains (e.g. a polynomial evaluator specialized on its degree) into Estrin's
+    // scheme, trading a little extra work and different rounding for a much shorter FMA dependency chain. Affects
+    // functions optimized afterwards. Also enabled by RUFUS_ESTRIN.
+    RuFuS &enable_polynomial_rebalancing();
+
+    // Packs JIT'd code and data into 2MB slabs instead of separate pages per compile, backed by transparent huge pages
+    // or, with `explicit_huge_pages`, hugetlbfs pages (falling back to normal pages if none are reserved). Code and
+    // read-only data live in shared memory, which only gets transparent huge pages when
+    // /sys/kernel/mm/transparent_hugepage/shmem_enabled is advise or always (it defaults to never); memory_stats()
+    // tells what was obtained. Code compiled together lands together: everything specialized before the first
+    // compile() is emitted in one go. Must be called before the first compile. Also enabled by RUFUS_HUGE_PAGES=1 (or
+    // =explicit).
+    RuFuS &enable_huge_pages(bool explicit_huge_pages = false);
+    MemoryStats memory_stats();
+
+    // Specializations created from here on count their calls and cycles, entry to return, in per-thread counters.
+    // Constrained or pinned variants count only the calls that pass their guard; parallel wrappers count calls, not
+    // chunks. Also enabled by RUFUS_INSTRUMENT.
+    RuFuS &enable_instrumentation();
+
+    // Totals of every instrumented kernel in the process so far, by symbol name
+    std::map<std::string, KernelStats> kernel_stats() const;
+
+    // For performance triage: every specialization compiled from here on leaves its optimization remarks
+    // (<name>.function.opt.yaml from optimize(), where vectorization happens, and <name>.jit.opt.yaml from the final
+    // pipeline), the optimized IR (<name>.ll) and its assembly (<name>.s) in `dump_dir`. Also enabled by
+    // RUFUS_DUMP_DIR.
+    RuFuS &enable_dumps(const std::string &dump_dir);
+
+    // Also enabled (with default options) by the RUFUS_PERF environment variable. Takes effect for code compiled
+    // afterwards.
+    RuFuS &enable_profiling();
+    RuFuS &enable_profiling(const ProfilingOptions &options);
+
     template <typename FuncType>
     FuncType compile(const std::string &demangled_name, const std::map<std::string, int> &const_args) {
         return reinterpret_cast<FuncType>(compile(demangled_name, const_args));
     };
 
+    template <typename FuncType>
+    FuncType compile(const std::string &demangled_name, const Specialization &spec) {
+        return reinterpret_cast<FuncType>(compile(demangled_name, spec));
+    };
+
     template <typename FuncType>
     FuncType compile(const std::string &demangled_name) {
         return reinterpret_cast<FuncType>(compile(demangled_name));
     };
 
+    // Same signature as compile(demangled_name, spec), but runs the range in parallel. The function must return void.
+    template <typename FuncType>
+    FuncType compile_parallel(const std::string &demangled_name, const Specialization &spec,
+                              const ParallelRange &range) {
+        return reinterpret_cast<FuncType>(compile_parallel(demangled_name, spec, range));
+    };
+
+    // Same signature as compile(demangled_name, spec), but the kernel reads each argument in `layouts` as one
+    // contiguous array per field (SoA), transposed from the caller's records into per-thread scratch on every call, so
+    // strided accesses become unit-stride vector loads. Every access through those arguments must be one element of a
+    // record.
+    template <typename FuncType>
+    FuncType compile_soa(const std::string &demangled_name, const Specialization &spec,
+                         const std::map<std::string, Layout> &layouts) {
+        return reinterpret_cast<FuncType>(compile_soa(demangled_name, spec, layouts));
+    };
+
+    // JITs `name`, a driver that runs the specialized stages one after another with all of them inlined, so the
+    // optimizer can fuse their loops and keep intermediates in registers or cache. Stages must return void. The
+    // driver returns void and takes the stages' remaining arguments (after `bindings`) in order of first appearance,
+    // each once.
+    template <typename FuncType>
+    FuncType compile_pipeline(const std::string &name, const std::vector<Stage> &stages) {
+        return reinterpret_cast<FuncType>(compile_pipeline(name, stages));
+    };
+
     RuFuS &print_module_ir();
     RuFuS &print_debug_info();
 
   private:
     std::uintptr_t compile(const std::string &demangled_name, const std::map<std::string, int> &const_args);
+    std::uintptr_t compile(const std::string &demangled_name, const Specialization &spec);
     std::uintptr_t compile(const std::string &demangled_name);
+    std::uintptr_t compile_parallel(const std::string &demangled_name, const Specialization &spec,
+                                    const ParallelRange &range);
+    std::uintptr_t compile_soa(const std::string &demangled_name, const Specialization &spec,
+                               const std::map<std::string, Layout> &layouts);
+    std::uintptr_t compile_pipeline(const std::string &name, const std::vector<Stage> &stages);
 };
 
 #endif
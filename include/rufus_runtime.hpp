@@ -0,0 +1,63 @@
+#ifndef RUFUS_RUNTIME_HPP
+#define RUFUS_RUNTIME_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+// Loads kernels RuFuS already compiled into a shared cache directory (see RuFuS::enable_shared_cache), without
+// LLVM. Entries are the self-contained x86-64 objects the JIT writes, or shared objects with the same naming; they
+// are linked against the host process and only ever loaded on the kind of CPU they were compiled for. A miss
+// returns nullptr, so callers can fall back to the JIT.
+class RuFuSRuntime {
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+
+  public:
+    // Same as RuFuS::KernelStats
+    struct KernelStats {
+        std::uint64_t calls = 0;
+        std::uint64_t cycles = 0;
+    };
+
+    // An empty cache_dir means RUFUS_CACHE_DIR
+    explicit RuFuSRuntime(const std::string &cache_dir = "");
+    ~RuFuSRuntime();
+
+    RuFuSRuntime(RuFuSRuntime &&) noexcept;
+    RuFuSRuntime &operator=(RuFuSRuntime &&) noexcept;
+
+    RuFuSRuntime(const RuFuSRuntime &) = delete;
+    RuFuSRuntime &operator=(const RuFuSRuntime &) = delete;
+
+    // Resolve `name` to `addr` in loaded code. Otherwise symbols come from the process (dlsym), which won't see
+    // symbols of a statically linked executable unless it was linked with -rdynamic.
+    RuFuSRuntime &define_symbol(const std::string &name, void *addr);
+
+    // Counters of instrumented kernels (see RuFuS::enable_instrumentation) loaded in this process, by symbol name
+    std::map<std::string, KernelStats> kernel_stats() const;
+
+    // Same key as RuFuS::compile(demangled_name, spec) for a spec of only const_args and function_args. Variants with
+    // constraints or field_values are loaded by symbol name. Returns 0 when the cache has no entry for it, or entries
+    // from several builds of the IR, since only RuFuS can tell which one is current.
+    template <typename FuncType>
+    FuncType load(const std::string &demangled_name, const std::map<std::string, int> &const_args,
+                  const std::map<std::string, std::string> &function_args = {}) {
+        return reinterpret_cast<FuncType>(load(demangled_name, const_args, function_args));
+    };
+
+    // By symbol name, e.g. `hot_loop_N_64_<hash>` or a wrapper from RuFuS::compile_parallel
+    template <typename FuncType>
+    FuncType load(const std::string &symbol_name) {
+        return reinterpret_cast<FuncType>(load(symbol_name));
+    };
+
+  private:
+    std::uintptr_t load(const std::string &demangled_name, const std::map<std::string, int> &const_args,
+                        const std::map<std::string, std::string> &function_args);
+    std::uintptr_t load(const std::string &symbol_name);
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef RUFUS_CACHE_KEY_HPP
+#define RUFUS_CACHE_KEY_HPP
+
+// Naming shared by the JIT and rufus_runtime, which has to find cache entries without LLVM
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+namespace rufus {
+
+// Symbol name of a specialized variant, e.g. `hot_loop_N_64_<hash>`. `constraints` maps an argument to the tag of the
+// facts assumed about it, e.g. `mul_16`.
+inline std::string specialized_name(const std::string &demangled_name, const std::map<std::string, int> &const_args,
+                                    const std::map<std::string, std::string> &function_args,
+                                    const std::map<std::string, std::string> &constraints = {}) {
+    auto basename_of = [](const std::string &name) { return name.substr(0, name.find('(')); };
+    std::string basename = basename_of(demangled_name);
+
+    // Create hash of full signature for uniqueness. Bound functions are part of the signature too, since two
+    // overloads with the same basename would otherwise collide.
+    std::string signature = demangled_name;
+    for (const auto &[name, target] : function_args)
+        signature += "|" + name + "=" + target;
+    std::hash<std::string> hasher;
+    size_t sig_hash = hasher(signature);
+
+    std::ostringstream oss;
+    oss << basename;
+
+    // Add const args
+    for (const auto &[name, value] : const_args)
+        oss << "_" << name << "_" << value;
+
+    // Add constrained args
+    for (const auto &[name, tag] : constraints)
+        oss << "_" << name << "_" << tag;
+
+    // Add bound functions, reduced to something that is a valid identifier
+    for (const auto &[name, target] : function_args) {
+        std::string target_base = basename_of(target);
+        std::replace_if(target_base.begin(), target_base.end(), [](unsigned char c) { return !std::isalnum(c); }, '_');
+        oss << "_" << name << "_" << target_base;
+    }
+
+    // Add short hash for overload disambiguation
+    oss << "_" << std::hex << std::setw(8) << std::setfill('0') << (sig_hash & 0xFFFFFFFF);
+
+    return oss.str();
+}
+
+// Identifies the host's instruction set (and what the OS enables of it), so an entry compiled on one kind of node is
+// never loaded on another
+inline const std::string &host_id() {
+    static const std::string id = [] {
+        std::uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](std::uint64_t word, int bytes) {
+            for (int i = 0; i < bytes; ++i) {
+                hash ^= (word >> (8 * i)) & 0xff;
+                hash *= 1099511628211ull;
+            }
+        };
+
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned eax, ebx, ecx, edx;
+        __cpuid(0, eax, ebx, ecx, edx);
+        const unsigned max_leaf = eax;
+        mix(ebx, 4), mix(edx, 4), mix(ecx, 4);
+
+        // Signature and features. EBX carries the APIC id, which differs between cores.
+        __cpuid(1, eax, ebx, ecx, edx);
+        const bool osxsave = ecx & bit_OSXSAVE;
+        mix(eax, 4), mix(ecx, 4), mix(edx, 4);
+
+        if (max_leaf >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            mix(ebx, 4), mix(ecx, 4), mix(edx, 4);
+        }
+
+        if (osxsave) {
+            unsigned xcr0_lo, xcr0_hi;
+            __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            mix(xcr0_lo, 4);
+        }
+#elif defined(__linux__)
+        mix(getauxval(AT_HWCAP), 8);
+        mix(getauxval(AT_HWCAP2), 8);
+#endif
+
+        char buf[17];
+        std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+        return std::string(buf);
+    }();
+    return id;
+}
+
+} // namespace rufus
+
+#endif
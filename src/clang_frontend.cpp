@@ -0,0 +1,59 @@
+#include "clang_frontend.hpp"
+
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/CodeGen/CodeGenAction.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/Utils.h>
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+
+namespace rufus {
+
+std::unique_ptr<llvm::Module> compile_source(const std::string &source, const std::vector<std::string> &flags,
+                                             llvm::LLVMContext &ctx) {
+    // The source only exists in memory. Everything else (e.g. system headers, for source that wasn't preprocessed)
+    // comes from the real file system.
+    constexpr const char *file_name = "/rufus/source.cpp";
+    auto memory_fs = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+    memory_fs->addFile(file_name, 0, llvm::MemoryBuffer::getMemBufferCopy(source, file_name));
+    auto fs = llvm::makeIntrusiveRefCnt<llvm::vfs::OverlayFileSystem>(llvm::vfs::getRealFileSystem());
+    fs->pushOverlay(memory_fs);
+
+    std::vector<const char *> args{"clang++"};
+    for (const std::string &flag : flags)
+        args.push_back(flag.c_str());
+    // Embedded source carries the target it was preprocessed for, which must match its IR
+    if (std::none_of(flags.begin(), flags.end(), [](const std::string &flag) { return flag.rfind("-march=", 0) == 0; }))
+        args.push_back("-march=native");
+    for (const char *flag : {"-O0", "-fno-discard-value-names", "-DNDEBUG", "-c", file_name})
+        args.push_back(flag);
+
+    auto diag_opts = llvm::makeIntrusiveRefCnt<clang::DiagnosticOptions>();
+    auto diags = clang::CompilerInstance::createDiagnostics(
+        diag_opts.get(), new clang::TextDiagnosticPrinter(llvm::errs(), diag_opts.get()));
+
+    clang::CreateInvocationOptions options;
+    options.Diags = diags;
+    options.VFS = fs;
+    std::shared_ptr<clang::CompilerInvocation> invocation = clang::createInvocation(args, options);
+    if (!invocation)
+        return nullptr;
+
+    clang::CompilerInstance CI;
+    CI.setInvocation(std::move(invocation));
+    CI.setDiagnostics(diags.get());
+    CI.createFileManager(fs);
+
+    clang::EmitLLVMOnlyAction action(&ctx);
+    if (!CI.ExecuteAction(action))
+        return nullptr;
+    return action.takeModule();
+}
+
+} // namespace rufus
@@ -0,0 +1,20 @@
+#ifndef RUFUS_CLANG_FRONTEND_HPP
+#define RUFUS_CLANG_FRONTEND_HPP
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rufus {
+
+// Compiles C++ source to -O0 IR for the host, the way embed_ir_as_header does at build time. `flags` are clang
+// driver flags, e.g. -std=c++20. Diagnostics go to llvm::errs(); nullptr on failure.
+std::unique_ptr<llvm::Module> compile_source(const std::string &source, const std::vector<std::string> &flags,
+                                             llvm::LLVMContext &ctx);
+
+} // namespace rufus
+
+#endif
@@ -0,0 +1,156 @@
+#include "horner_to_estrin.hpp"
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Module.h>
+
+#include <optional>
+
+namespace rufus {
+
+namespace {
+
+struct FMA {
+    llvm::Value *mul0;
+    llvm::Value *mul1;
+    llvm::Value *addend;
+};
+
+// llvm.fma, llvm.fmuladd, or a call to libm's fma (which never sets errno)
+std::optional<FMA> match_fma(llvm::Value *V) {
+    auto *CI = llvm::dyn_cast<llvm::CallInst>(V);
+    if (!CI || CI->arg_size() != 3 || !CI->getType()->isFPOrFPVectorTy())
+        return std::nullopt;
+
+    llvm::Function *callee = CI->getCalledFunction();
+    if (!callee)
+        return std::nullopt;
+
+    const llvm::Intrinsic::ID id = callee->getIntrinsicID();
+    const llvm::StringRef name = callee->getName();
+    if (id != llvm::Intrinsic::fma && id != llvm::Intrinsic::fmuladd &&
+        !(callee->isDeclaration() && (name == "fma" || name == "fmaf" || name == "fmal")))
+        return std::nullopt;
+
+    return FMA{CI->getArgOperand(0), CI->getArgOperand(1), CI->getArgOperand(2)};
+}
+
+// The multiplicand that isn't x, if x is one of them
+llvm::Value *accumulator(const FMA &fma, llvm::Value *x) {
+    if (fma.mul1 == x)
+        return fma.mul0;
+    if (fma.mul0 == x)
+        return fma.mul1;
+    return nullptr;
+}
+
+struct HornerChain {
+    llvm::Value *x = nullptr;
+    llvm::SmallVector<llvm::Value *, 16> coefs;    // lowest degree first
+    llvm::SmallVector<llvm::CallInst *, 16> steps; // root first
+};
+
+// Follows accumulators down from `root` while they are single-use FMAs against the same x in the same block
+HornerChain match_chain(llvm::CallInst *root) {
+    const FMA root_fma = *match_fma(root);
+
+    HornerChain best;
+    for (llvm::Value *x : {root_fma.mul1, root_fma.mul0}) {
+        HornerChain chain;
+        chain.x = x;
+
+        llvm::CallInst *step = root;
+        FMA fma = root_fma;
+        while (true) {
+            chain.coefs.push_back(fma.addend);
+            chain.steps.push_back(step);
+
+            llvm::Value *acc = accumulator(fma, x);
+            auto *next = llvm::dyn_cast<llvm::CallInst>(acc);
+            std::optional<FMA> next_fma = next ? match_fma(next) : std::nullopt;
+            if (!next_fma || !next->hasOneUse() || next->getParent() != root->getParent() || next == x ||
+                !accumulator(*next_fma, x)) {
+                chain.coefs.push_back(acc);
+                break;
+            }
+
+            step = next;
+            fma = *next_fma;
+        }
+
+        if (chain.steps.size() > best.steps.size())
+            best = std::move(chain);
+    }
+
+    return best;
+}
+
+void rewrite_estrin(const HornerChain &chain) {
+    llvm::CallInst *root = chain.steps.front();
+    llvm::Module *M = root->getModule();
+
+    llvm::IRBuilder<> B(root);
+    B.setFastMathFlags(root->getFastMathFlags());
+
+    const bool fmuladd = root->getCalledFunction()->getIntrinsicID() == llvm::Intrinsic::fmuladd;
+    llvm::Function *fma_fn = llvm::Intrinsic::getDeclaration(
+        M, fmuladd ? llvm::Intrinsic::fmuladd : llvm::Intrinsic::fma, {root->getType()});
+
+    // Pair terms against x, then x^2, x^4, ...
+    llvm::SmallVector<llvm::Value *, 16> terms(chain.coefs.begin(), chain.coefs.end());
+    llvm::Value *power = chain.x;
+    while (terms.size() > 1) {
+        llvm::SmallVector<llvm::Value *, 16> next;
+        for (size_t i = 0; i + 1 < terms.size(); i += 2)
+            next.push_back(B.CreateCall(fma_fn, {terms[i + 1], power, terms[i]}));
+        if (terms.size() % 2)
+            next.push_back(terms.back());
+
+        terms = std::move(next);
+        if (terms.size() > 1)
+            power = B.CreateFMul(power, power);
+    }
+
+    root->replaceAllUsesWith(terms.front());
+    for (llvm::CallInst *step : chain.steps)
+        step->eraseFromParent();
+}
+
+} // namespace
+
+llvm::PreservedAnalyses HornerToEstrinPass::run(llvm::Function &F, llvm::FunctionAnalysisManager &) {
+    llvm::SmallVector<HornerChain, 4> chains;
+
+    for (llvm::BasicBlock &BB : F) {
+        // Bottom-up, so each chain is seen from its root
+        llvm::SmallPtrSet<llvm::Instruction *, 32> consumed;
+        for (llvm::Instruction &I : llvm::reverse(BB)) {
+            auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+            if (!CI || consumed.contains(CI) || !match_fma(CI))
+                continue;
+
+            HornerChain chain = match_chain(CI);
+            if (chain.steps.size() < min_degree)
+                continue;
+
+            consumed.insert(chain.steps.begin(), chain.steps.end());
+            chains.push_back(std::move(chain));
+        }
+    }
+
+    for (const HornerChain &chain : chains)
+        rewrite_estrin(chain);
+
+    if (chains.empty())
+        return llvm::PreservedAnalyses::all();
+
+    llvm::PreservedAnalyses PA;
+    PA.preserveSet<llvm::CFGAnalyses>();
+    return PA;
+}
+
+} // namespace rufus
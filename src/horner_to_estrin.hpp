@@ -0,0 +1,21 @@
+#ifndef RUFUS_HORNER_TO_ESTRIN_HPP
+#define RUFUS_HORNER_TO_ESTRIN_HPP
+
+#include <llvm/IR/PassManager.h>
+
+namespace rufus {
+
+// Rebalances fully unrolled Horner chains, ((c_n * x + c_{n-1}) * x + ...) * x + c_0 built from fma/fmuladd calls,
+// into Estrin's scheme: neighbouring coefficients are paired with x, the pairs with x^2, and so on. The dependency
+// chain goes from n FMAs to about log2(n), at the cost of the extra squarings and a different rounding order.
+struct HornerToEstrinPass : llvm::PassInfoMixin<HornerToEstrinPass> {
+    explicit HornerToEstrinPass(unsigned min_degree = 4) : min_degree(min_degree) {}
+
+    llvm::PreservedAnalyses run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+
+    unsigned min_degree;
+};
+
+} // namespace rufus
+
+#endif
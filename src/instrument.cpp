@@ -0,0 +1,121 @@
+#include "instrument.hpp"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace rufus {
+
+namespace {
+
+constexpr std::size_t page_size = 1024;
+constexpr std::size_t max_pages = 64;
+
+struct Slot {
+    std::atomic<std::uint64_t> calls{0};
+    std::atomic<std::uint64_t> cycles{0};
+};
+
+// Only the owning thread writes, so the counters don't need read-modify-write atomics; relaxed stores just keep the
+// readers' loads well defined. Pages are allocated as ids show up and never move.
+struct Table {
+    std::array<std::atomic<Slot *>, max_pages> pages{};
+
+    ~Table() {
+        for (auto &page : pages)
+            delete[] page.load(std::memory_order_relaxed);
+    }
+
+    Slot *slot(std::uint32_t id) {
+        const std::size_t page = id / page_size;
+        if (page >= max_pages)
+            return nullptr;
+
+        Slot *slots = pages[page].load(std::memory_order_relaxed);
+        if (!slots) {
+            slots = new Slot[page_size];
+            pages[page].store(slots, std::memory_order_release);
+        }
+        return &slots[id % page_size];
+    }
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::map<std::string, std::uint32_t> ids;
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<Table>> tables;
+};
+
+// Never destroyed: kernels may still return on other threads while the process exits
+Registry &registry() {
+    static Registry *instance = new Registry;
+    return *instance;
+}
+
+std::uint32_t register_kernel(const char *name) {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    auto [it, inserted] = reg.ids.emplace(name, static_cast<std::uint32_t>(reg.names.size()) + 1);
+    if (inserted)
+        reg.names.push_back(name);
+    return it->second;
+}
+
+Table &local_table() {
+    thread_local Table *table = [] {
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.tables.push_back(std::make_unique<Table>());
+        return reg.tables.back().get();
+    }();
+    return *table;
+}
+
+} // namespace
+
+std::map<std::string, KernelCounters> kernel_counters() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    std::map<std::string, KernelCounters> totals;
+    for (const std::string &name : reg.names)
+        totals[name];
+
+    for (const auto &table : reg.tables) {
+        for (std::size_t page = 0; page < max_pages; ++page) {
+            const Slot *slots = table->pages[page].load(std::memory_order_acquire);
+            if (!slots)
+                continue;
+
+            for (std::size_t i = 0; i < page_size; ++i) {
+                const std::size_t id = page * page_size + i;
+                if (id == 0 || id > reg.names.size())
+                    continue;
+                KernelCounters &total = totals[reg.names[id - 1]];
+                total.calls += slots[i].calls.load(std::memory_order_relaxed);
+                total.cycles += slots[i].cycles.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return totals;
+}
+
+} // namespace rufus
+
+extern "C" void rufus_instrument_record(std::uint32_t *id, const char *name, std::uint64_t cycles) {
+    std::atomic_ref<std::uint32_t> kernel_id(*id);
+    std::uint32_t value = kernel_id.load(std::memory_order_relaxed);
+    if (!value) {
+        value = rufus::register_kernel(name);
+        kernel_id.store(value, std::memory_order_relaxed);
+    }
+
+    rufus::Slot *slot = rufus::local_table().slot(value);
+    if (!slot)
+        return;
+    slot->calls.store(slot->calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slot->cycles.store(slot->cycles.load(std::memory_order_relaxed) + cycles, std::memory_order_relaxed);
+}
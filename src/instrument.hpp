@@ -0,0 +1,27 @@
+#ifndef RUFUS_INSTRUMENT_HPP
+#define RUFUS_INSTRUMENT_HPP
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace rufus {
+
+// Call and cycle counters of instrumented kernels. Every thread records into its own table, so a call costs two plain
+// stores on memory no other thread writes. Tables are kept after their thread exits, so totals never go down.
+struct KernelCounters {
+    std::uint64_t calls = 0;
+    std::uint64_t cycles = 0;
+};
+
+// Summed over all threads, by kernel name
+std::map<std::string, KernelCounters> kernel_counters();
+
+} // namespace rufus
+
+// Called by instrumented kernels on each return. `id` is a zero-initialized slot in the kernel's own data that gets
+// the kernel's id on its first call, so ids don't have to agree between the process that compiled the kernel and the
+// one running it.
+extern "C" void rufus_instrument_record(std::uint32_t *id, const char *name, std::uint64_t cycles);
+
+#endif
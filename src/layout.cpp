@@ -0,0 +1,107 @@
+#include "layout.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t alignment = 64;
+constexpr std::size_t min_block_size = std::size_t(1) << 20;
+
+struct Block {
+    char *data = nullptr;
+    std::size_t size = 0;
+    std::size_t top = 0;
+
+    ~Block() { std::free(data); }
+};
+
+// A stack of blocks. Allocation bumps the current block or moves on to the next one that fits; nothing is freed
+// until the thread exits, so steady-state calls don't touch the allocator.
+struct Arena {
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::size_t current = 0;
+
+    void *alloc(std::size_t bytes) {
+        bytes = (std::max<std::size_t>(bytes, 1) + alignment - 1) / alignment * alignment;
+        for (; current < blocks.size(); ++current) {
+            Block &block = *blocks[current];
+            if (block.top + bytes <= block.size) {
+                void *ptr = block.data + block.top;
+                block.top += bytes;
+                return ptr;
+            }
+        }
+
+        auto block = std::make_unique<Block>();
+        block->size = std::max(bytes, blocks.empty() ? min_block_size : 2 * blocks.back()->size);
+        block->data = static_cast<char *>(std::aligned_alloc(alignment, block->size));
+        if (!block->data)
+            return nullptr;
+        block->top = bytes;
+        blocks.push_back(std::move(block));
+        current = blocks.size() - 1;
+        return blocks.back()->data;
+    }
+
+    void release(void *ptr) {
+        char *p = static_cast<char *>(ptr);
+        for (std::size_t i = current + 1; i-- > 0;) {
+            Block &block = *blocks[i];
+            if (p >= block.data && p < block.data + block.size) {
+                block.top = p - block.data;
+                current = i;
+                return;
+            }
+            block.top = 0;
+        }
+    }
+};
+
+thread_local Arena arena;
+
+template <typename T>
+void transpose(T *out, const T *in, std::int64_t rows, std::int64_t cols) {
+    for (std::int64_t r = 0; r < rows; ++r)
+        for (std::int64_t c = 0; c < cols; ++c)
+            out[c * rows + r] = in[r * cols + c];
+}
+
+// out[c][r] = in[r][c] for rows x cols elements
+void transpose(void *out, const void *in, std::int64_t rows, std::int64_t cols, std::int64_t element_size) {
+    switch (element_size) {
+    case 4:
+        transpose(static_cast<std::uint32_t *>(out), static_cast<const std::uint32_t *>(in), rows, cols);
+        return;
+    case 8:
+        transpose(static_cast<std::uint64_t *>(out), static_cast<const std::uint64_t *>(in), rows, cols);
+        return;
+    default:
+        for (std::int64_t r = 0; r < rows; ++r)
+            for (std::int64_t c = 0; c < cols; ++c)
+                std::memcpy(static_cast<char *>(out) + (c * rows + r) * element_size,
+                            static_cast<const char *>(in) + (r * cols + c) * element_size, element_size);
+    }
+}
+
+} // namespace
+
+extern "C" void *rufus_arena_alloc(std::int64_t bytes) { return arena.alloc(bytes); }
+
+extern "C" void rufus_arena_release(void *ptr) {
+    if (ptr)
+        arena.release(ptr);
+}
+
+extern "C" void rufus_aos_to_soa(void *soa, const void *aos, std::int64_t count, std::int64_t fields,
+                                 std::int64_t element_size) {
+    transpose(soa, aos, count, fields, element_size);
+}
+
+extern "C" void rufus_soa_to_aos(void *aos, const void *soa, std::int64_t count, std::int64_t fields,
+                                 std::int64_t element_size) {
+    transpose(aos, soa, fields, count, element_size);
+}
@@ -0,0 +1,19 @@
+#ifndef RUFUS_LAYOUT_HPP
+#define RUFUS_LAYOUT_HPP
+
+#include <cstdint>
+
+// Runtime for the layout wrappers RuFuS JITs around SoA-rewritten kernels (see RuFuS::compile_soa)
+
+// Scratch memory from a per-thread arena, 64-byte aligned. Released in reverse order of allocation, by handing the
+// pointer back; blocks are kept for the next call.
+extern "C" void *rufus_arena_alloc(std::int64_t bytes);
+extern "C" void rufus_arena_release(void *ptr);
+
+// Between `count` records of `fields` elements of `element_size` bytes, and one contiguous array per field
+extern "C" void rufus_aos_to_soa(void *soa, const void *aos, std::int64_t count, std::int64_t fields,
+                                 std::int64_t element_size);
+extern "C" void rufus_soa_to_aos(void *aos, const void *soa, std::int64_t count, std::int64_t fields,
+                                 std::int64_t element_size);
+
+#endif
@@ -1,10 +1,27 @@
 #include <rufus.hpp>
 
+#include "cache_key.hpp"
+#ifdef RUFUS_HAS_CLANG
+#include "clang_frontend.hpp"
+#endif
+#include "horner_to_estrin.hpp"
+#include "instrument.hpp"
+#include "layout.hpp"
+#include "slab_memory_manager.hpp"
+#include "thread_pool.hpp"
+
 // LLVM Core
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LLVMRemarkStreamer.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Remarks/RemarkStreamer.h>
 
 // LLVM Passes and Optimization
 #include <llvm/MC/TargetRegistry.h>
@@ -14,17 +31,34 @@
 #include <llvm/TargetParser/Host.h>
 
 // LLVM JIT
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/EPCEHFrameRegistrar.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/LazyReexports.h>
 
 // LLVM Support
 #include <llvm/Demangle/Demangle.h>
 #include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/IPO/Internalize.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 
 // Core Pass Infrastructure
 #include <llvm/Analysis/CGSCCPassManager.h>
 #include <llvm/Analysis/LoopAnalysisManager.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/Passes/PassBuilder.h>
 
 // Individual Optimization Passes
@@ -32,12 +66,15 @@
 #include <llvm/Transforms/Scalar/DCE.h>
 #include <llvm/Transforms/Scalar/EarlyCSE.h>
 #include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopFuse.h>
 #include <llvm/Transforms/Scalar/LoopRotation.h>
 #include <llvm/Transforms/Scalar/LoopUnrollPass.h>
 #include <llvm/Transforms/Scalar/SCCP.h>
 #include <llvm/Transforms/Scalar/SROA.h>
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
 #include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
 #include <llvm/Transforms/Vectorize/LoopVectorize.h>
 #include <llvm/Transforms/Vectorize/SLPVectorizer.h>
 
@@ -49,85 +86,407 @@
 #include <llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderPerf.h>
 
 #include <algorithm>
-#include <iomanip>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace {
+
+// Appends every function JIT'd through the linking layer to /tmp/perf-<pid>.map, the format `perf report` reads for
+// symbols of anonymous executable memory.
+class PerfMapPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+  public:
+    PerfMapPlugin() {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        std::error_code EC;
+        out = std::make_unique<llvm::raw_fd_ostream>(path, EC, llvm::sys::fs::OF_Append);
+        if (EC) {
+            llvm::errs() << "Failed to open perf map " << path << ": " << EC.message() << "\n";
+            out.reset();
+        }
+    }
+
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR, llvm::jitlink::LinkGraph &G,
+                          llvm::jitlink::PassConfiguration &Config) override {
+        Config.PostFixupPasses.push_back([this](llvm::jitlink::LinkGraph &G) {
+            write_symbols(G);
+            return llvm::Error::success();
+        });
+    }
+
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility &MR) override { return llvm::Error::success(); }
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD, llvm::orc::ResourceKey K) override {
+        return llvm::Error::success();
+    }
+    void notifyTransferringResources(llvm::orc::JITDylib &JD, llvm::orc::ResourceKey DstKey,
+                                     llvm::orc::ResourceKey SrcKey) override {}
+
+  private:
+    void write_symbols(llvm::jitlink::LinkGraph &G) {
+        if (!out)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto *Sym : G.defined_symbols()) {
+            if (!Sym->hasName() || !Sym->isCallable() || Sym->getSize() == 0)
+                continue;
+            *out << llvm::format("%llx %llx ", (unsigned long long)Sym->getAddress().getValue(),
+                                 (unsigned long long)Sym->getSize())
+                 << llvm::demangle(Sym->getName().str()) << "\n";
+        }
+        out->flush();
+    }
+
+    std::mutex mutex;
+    std::unique_ptr<llvm::raw_fd_ostream> out;
+};
+
+// Defines one symbol whose code is produced by `materializer` when the symbol is first looked up. Behind a lazy
+// reexport stub, that is the first call through the stub.
+class DeferredMaterializationUnit : public llvm::orc::MaterializationUnit {
+  public:
+    using Materializer = llvm::unique_function<void(std::unique_ptr<llvm::orc::MaterializationResponsibility>)>;
+
+    DeferredMaterializationUnit(llvm::orc::SymbolStringPtr name, llvm::JITSymbolFlags flags, Materializer materializer)
+        : MaterializationUnit(Interface(llvm::orc::SymbolFlagsMap{{std::move(name), flags}}, nullptr)),
+          materializer(std::move(materializer)) {}
+
+    llvm::StringRef getName() const override { return "RuFuSDeferredSpecialization"; }
+
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+        materializer(std::move(R));
+    }
+
+  private:
+    void discard(const llvm::orc::JITDylib &JD, const llvm::orc::SymbolStringPtr &Name) override {}
+
+    Materializer materializer;
+};
+
+// Reached from a lazy stub whose body failed to compile. There is nothing sensible left to call.
+void lazy_compile_failed() {
+    llvm::errs() << "RuFuS: lazy compilation failed, aborting\n";
+    abort();
+}
+
+// Host target description and the JIT. Owned by one RuFuS, or shared by every RuFuS in the process created with
+// RuFuS::Engine::Shared. Each half is set up on first use.
+struct JITEngine {
+    std::once_flag target_flag;
+    std::once_flag jit_flag;
+
+    std::unique_ptr<llvm::TargetMachine> TM;
+    std::string target_triple;
+    std::string CPU;
+    llvm::SubtargetFeatures Features;
+    unsigned MaxVectorWidth = 128;
+
+    std::unique_ptr<llvm::orc::LLJIT> JIT;
+    unsigned num_dylibs = 0;
+
+    // Slab allocation of JIT'd memory, decided before the JIT is created. Owned by the linking layer.
+    std::optional<rufus::SlabMemoryManager::HugePages> huge_pages;
+    rufus::SlabMemoryManager *memory = nullptr;
+
+    std::once_flag lazy_flag;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> LCTM;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> ISM;
+
+    bool profiling = false;
+    bool perf_map_enabled = false;
+    bool jitdump_enabled = false;
+    std::optional<RuFuS::ProfilingOptions> pending_profiling;
+
+    // Guards the JIT setup state above. The TargetMachine caches subtargets without locking, so passes using it are
+    // serialized on `passes_mutex`.
+    std::mutex mutex;
+    std::mutex passes_mutex;
+
+    JITEngine &target() {
+        std::call_once(target_flag, [this] { initialize_target(); });
+        return *this;
+    }
+
+    llvm::orc::LLJIT *jit() {
+        target();
+        std::call_once(jit_flag, [this] { initialize_jit(); });
+        return JIT.get();
+    }
+
+    // Call-through machinery for lazy stubs, set up the first time it's needed
+    bool lazy_support() {
+        std::call_once(lazy_flag, [this] { initialize_lazy_support(); });
+        return LCTM && ISM;
+    }
+
+    void initialize_target();
+    void initialize_jit();
+    void initialize_lazy_support();
+    void define_host_symbols(llvm::ArrayRef<std::pair<const char *, llvm::orc::ExecutorAddr>> symbols);
+    void enable_profiling(const RuFuS::ProfilingOptions &options);
+    void enable_huge_pages(rufus::SlabMemoryManager::HugePages kind);
+    void apply_profiling(const RuFuS::ProfilingOptions &options);
+
+    static std::shared_ptr<JITEngine> shared() {
+        static std::shared_ptr<JITEngine> engine = std::make_shared<JITEngine>();
+        return engine;
+    }
+};
+
+// Splits the byte offset S of an access into records of `record_size` bytes (`fields` elements each). Returns S with
+// the offset into the record taken out and the rest scaled to one element per record, i.e. the offset of the same
+// element in a field's own array, and sets `field_offset`. nullptr unless everything but a constant term is a whole
+// number of records.
+const llvm::SCEV *split_records(llvm::ScalarEvolution &SE, const llvm::SCEV *S, std::int64_t fields,
+                                std::int64_t record_size, std::int64_t &field_offset) {
+    field_offset = 0;
+
+    if (auto *C = llvm::dyn_cast<llvm::SCEVConstant>(S)) {
+        const std::int64_t k = C->getAPInt().getSExtValue();
+        field_offset = (k % record_size + record_size) % record_size;
+        return SE.getConstant(S->getType(), (k - field_offset) / fields, true);
+    }
+
+    if (auto *Add = llvm::dyn_cast<llvm::SCEVAddExpr>(S)) {
+        llvm::SmallVector<const llvm::SCEV *, 4> terms;
+        for (const llvm::SCEV *Op : Add->operands()) {
+            std::int64_t op_offset = 0;
+            const llvm::SCEV *term = split_records(SE, Op, fields, record_size, op_offset);
+            if (!term)
+                return nullptr;
+            field_offset += op_offset;
+            terms.push_back(term);
+        }
+        return field_offset < record_size ? SE.getAddExpr(terms) : nullptr;
+    }
+
+    if (auto *AddRec = llvm::dyn_cast<llvm::SCEVAddRecExpr>(S); AddRec && AddRec->isAffine()) {
+        std::int64_t step_offset = 0;
+        const llvm::SCEV *start = split_records(SE, AddRec->getStart(), fields, record_size, field_offset);
+        const llvm::SCEV *step = split_records(SE, AddRec->getStepRecurrence(SE), fields, record_size, step_offset);
+        if (!start || !step || step_offset)
+            return nullptr;
+        return SE.getAddRecExpr(start, step, AddRec->getLoop(), llvm::SCEV::FlagAnyWrap);
+    }
+
+    // A whole number of records times anything. Constants come first in canonical form.
+    if (auto *Mul = llvm::dyn_cast<llvm::SCEVMulExpr>(S)) {
+        auto *C = llvm::dyn_cast<llvm::SCEVConstant>(Mul->getOperand(0));
+        if (!C || C->getAPInt().getSExtValue() % record_size)
+            return nullptr;
+
+        llvm::SmallVector<const llvm::SCEV *, 4> factors(Mul->operands().begin(), Mul->operands().end());
+        factors[0] = SE.getConstant(S->getType(), C->getAPInt().getSExtValue() / fields, true);
+        return SE.getMulExpr(factors);
+    }
+
+    return nullptr;
+}
+
+} // namespace
 
 // Private interface
 struct RuFuS::Impl {
-    Impl();
+    Impl(RuFuS::Engine engine_kind);
+    ~Impl();
+
+    std::shared_ptr<JITEngine> engine;
+    bool shared_engine;
+    llvm::orc::JITDylib *JD = nullptr;
+
+    // Compile-on-first-call mode: stubs live in JD, the bodies they trigger in lazy_JD
+    bool lazy = false;
+    llvm::orc::JITDylib *lazy_JD = nullptr;
+
+    // Lazy bodies are built on whichever thread first calls the stub, so everything touching M takes this
+    std::recursive_mutex module_mutex;
 
     llvm::LLVMContext Ctx;
     llvm::SMDiagnostic Err;
     std::unique_ptr<llvm::Module> M;
-    std::unique_ptr<llvm::orc::LLJIT> JIT;
-    std::unique_ptr<llvm::TargetMachine> TM;
 
+    // Source templates are instantiated from, see instantiate()
+    std::string source;
+    std::vector<std::string> source_flags;
+
+    // Reused by every optimization run. Runs over throwaway JIT modules clear the caches afterwards.
+    std::unique_ptr<llvm::PassBuilder> PB;
     llvm::LoopAnalysisManager LAM;
     llvm::FunctionAnalysisManager FAM;
     llvm::CGSCCAnalysisManager CGAM;
     llvm::ModuleAnalysisManager MAM;
+    std::optional<llvm::ModulePassManager> jit_pipeline;
 
-    std::string target_triple;
-    std::string CPU;
-    llvm::SubtargetFeatures Features;
+    // Run HornerToEstrinPass on unrolled polynomial chains
+    bool rebalance_polynomials = false;
 
-    void initialize_target();
+    // Count calls and cycles of each specialization, see instrument_function
+    bool instrument = false;
+
+    // Drivers from compile_pipeline, which get loop fusion on top of optimize_function
+    llvm::SmallPtrSet<llvm::Function *, 4> pipeline_drivers;
+
+    JITEngine &target() { return engine->target(); }
+    llvm::orc::LLJIT *jit();
     void initialize_pass_managers();
-    void initialize_jit();
+    void clear_analyses();
+    llvm::TargetMachine *object_target_machine();
     llvm::Function *find_function_by_demangled_name(const std::string &target);
     llvm::FunctionType *create_specialized_function_type(llvm::Function *F, const std::set<unsigned> &args_to_remove);
-    std::string create_specialized_name(const std::string &demangled_name,
-                                        const std::map<std::string, int> &const_args);
+    std::string create_specialized_name(const std::string &demangled_name, const RuFuS::Specialization &spec);
     void replace_alloca_with_constant(llvm::AllocaInst *AI, llvm::Constant *ConstVal);
     llvm::Function *clone_and_specialize_arguments(llvm::Function *F, const std::map<std::string, int> &const_args,
+                                                   const std::map<std::string, llvm::Function *> &function_args,
                                                    const std::string &specialized_name);
+    void guard_entry(llvm::Function *F, llvm::Function *fallback,
+                     llvm::function_ref<void(llvm::IRBuilder<> &, llvm::SmallVectorImpl<llvm::Value *> &)> build_facts);
+    void add_constraints(llvm::Function *F, llvm::Function *fallback,
+                         const std::map<std::string, RuFuS::Constraint> &constraints);
+    bool pin_fields(llvm::Function *F, llvm::Function *fallback, const std::vector<RuFuS::FieldValue> &fields);
     void specialize_internal_variables(llvm::Function *F, const std::map<std::string, int> &const_vars);
-    void inline_all_calls(llvm::Function *F);
+    void promote_allocas(llvm::Function *F);
+    bool devirtualize_calls(llvm::Function *F, const llvm::SmallPtrSetImpl<llvm::Function *> &targets);
+    void inline_all_calls(llvm::Function *F, int max_rounds = 8);
     void optimize_function(llvm::Function *F);
     void disable_optimizations();
-    void optimize_for_jit(llvm::Module *M, llvm::TargetMachine *TM);
+    void disable_optimizations(llvm::Function &F);
+    bool link_instantiation(std::unique_ptr<llvm::Module> instance);
+    void optimize_for_jit(llvm::Module *M, llvm::StringRef name);
+    std::string dump_path(const std::string &file_name);
+    std::unique_ptr<llvm::ToolOutputFile> open_remarks(llvm::LLVMContext &ctx, const std::string &file_name);
+    void close_remarks(llvm::LLVMContext &ctx, std::unique_ptr<llvm::ToolOutputFile> remarks);
+    void dump_module(llvm::Module &module, llvm::StringRef name);
     void strip_loop_metadata(llvm::Function *F);
     void fix_function_attributes(llvm::Function *F);
+    void retarget(llvm::Function &F);
+    void instrument_function(llvm::Function *F);
+
+    // For variants only ever called from something instrumented already
+    template <typename Specialize>
+    void specialize_uninstrumented(Specialize &&specialize) {
+        const bool was_instrumented = std::exchange(instrument, false);
+        specialize();
+        instrument = was_instrumented;
+    }
     void mark_lambdas_for_inlining(llvm::Function *F);
+    std::unique_ptr<llvm::Module> clone_module(llvm::LLVMContext &ctx);
+    void make_self_contained(llvm::Module &module, llvm::StringRef keep);
+    std::unique_ptr<llvm::MemoryBuffer> compile_object(llvm::Module &module);
+    std::unique_ptr<llvm::MemoryBuffer> shared_object(llvm::Function *target_func);
+    std::uintptr_t compile_shared(llvm::Function *target_func);
+    std::optional<llvm::orc::ThreadSafeModule> self_contained_module(llvm::Function *target_func);
+    std::uintptr_t compile_lazy(llvm::Function *target_func);
+    std::int64_t parallel_grain(std::int64_t trip_count);
+    llvm::Function *create_pipeline_driver(const std::string &name, const std::vector<llvm::Function *> &stages,
+                                           const std::vector<RuFuS::Stage> &stage_specs);
+    bool rewrite_to_soa(llvm::Function *F, llvm::Argument *base, const RuFuS::Layout &layout, llvm::Value *count);
+    llvm::Function *create_layout_wrapper(const std::string &wrapper_name, llvm::Function *body,
+                                          const std::map<std::string, RuFuS::Layout> &layouts,
+                                          const std::map<std::string, int> &const_args);
+    llvm::Function *create_parallel_wrapper(const std::string &wrapper_name, llvm::Function *body,
+                                            llvm::Function *remainder, const RuFuS::ParallelRange &range,
+                                            std::optional<std::int64_t> trip_count, std::int64_t grain);
     std::map<llvm::Function *, bool> is_optimized;
 
-    unsigned MaxVectorWidth = 128;
+    // Node-local object cache shared between processes, see compile_shared
+    std::string cache_dir;
+    std::unique_ptr<llvm::TargetMachine> ObjTM;
+
+    // Remarks, optimized IR and assembly of everything compiled, see dump_module
+    std::string dump_dir;
+
     bool first_compile = true;
 
     llvm::raw_ostream &debug_out;
 };
 
-RuFuS::Impl::Impl() : debug_out(getenv("RUFUS_DEBUG") ? llvm::outs() : llvm::nulls()) {
-    initialize_target();
-    initialize_pass_managers();
-    initialize_jit();
+RuFuS::Impl::Impl(RuFuS::Engine engine_kind)
+    : engine(engine_kind == RuFuS::Engine::Shared ? JITEngine::shared() : std::make_shared<JITEngine>()),
+      shared_engine(engine_kind == RuFuS::Engine::Shared),
+      debug_out(getenv("RUFUS_DEBUG") ? llvm::outs() : llvm::nulls()) {
+    if (const char *dir = getenv("RUFUS_CACHE_DIR"))
+        cache_dir = dir;
+    if (const char *dir = getenv("RUFUS_DUMP_DIR"))
+        dump_dir = dir;
+    lazy = getenv("RUFUS_LAZY") != nullptr;
+    rebalance_polynomials = getenv("RUFUS_ESTRIN") != nullptr;
+    instrument = getenv("RUFUS_INSTRUMENT") != nullptr;
 }
 
-std::string RuFuS::Impl::create_specialized_name(const std::string &demangled_name,
-                                                 const std::map<std::string, int> &const_args) {
-    size_t paren_pos = demangled_name.find('(');
-    std::string basename = demangled_name.substr(0, paren_pos);
+RuFuS::Impl::~Impl() {
+    // Code in a shared engine outlives us otherwise
+    if (!shared_engine)
+        return;
 
-    // Create hash of full signature for uniqueness
-    std::hash<std::string> hasher;
-    size_t sig_hash = hasher(demangled_name);
+    for (llvm::orc::JITDylib *dylib : {JD, lazy_JD}) {
+        if (!dylib)
+            continue;
+        if (auto err = engine->JIT->getExecutionSession().removeJITDylib(*dylib))
+            llvm::errs() << "Failed to remove JITDylib: " << llvm::toString(std::move(err)) << "\n";
+    }
+}
 
-    std::ostringstream oss;
-    oss << basename;
+llvm::orc::LLJIT *RuFuS::Impl::jit() {
+    llvm::orc::LLJIT *JIT = engine->jit();
+    if (!JIT || JD)
+        return JIT;
+
+    if (!shared_engine) {
+        JD = &JIT->getMainJITDylib();
+        return JIT;
+    }
+
+    // Instances sharing the engine get their own dylib, so equal names in their IR don't collide
+    std::string name;
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        name = "rufus." + std::to_string(engine->num_dylibs++);
+    }
+    auto jd_or_err = JIT->createJITDylib(name);
+    if (!jd_or_err) {
+        llvm::errs() << "Failed to create JITDylib: " << llvm::toString(jd_or_err.takeError()) << "\n";
+        return nullptr;
+    }
+    JD = &*jd_or_err;
+
+    // Host symbols are defined in (or generated by) the main dylib
+    JD->addToLinkOrder(JIT->getMainJITDylib());
+    return JIT;
+}
 
-    // Add const args
-    for (const auto &[name, value] : const_args)
-        oss << "_" << name << "_" << value;
+std::string RuFuS::Impl::create_specialized_name(const std::string &demangled_name,
+                                                 const RuFuS::Specialization &spec) {
+    // e.g. `ge_64_le_256_mul_16`
+    std::map<std::string, std::string> constraint_tags;
+    for (const auto &[name, constraint] : spec.constraints) {
+        std::string tag;
+        if (constraint.min)
+            tag += "_ge_" + std::to_string(*constraint.min);
+        if (constraint.max)
+            tag += "_le_" + std::to_string(*constraint.max);
+        if (constraint.multiple_of > 1)
+            tag += "_mul_" + std::to_string(constraint.multiple_of);
+        if (!tag.empty())
+            constraint_tags[name] = tag.substr(1);
+    }
 
-    // Add short hash for overload disambiguation
-    oss << "_" << std::hex << std::setw(8) << std::setfill('0') << (sig_hash & 0xFFFFFFFF);
+    // e.g. `at_8_eq_64`, one per pinned field
+    for (const RuFuS::FieldValue &field : spec.field_values) {
+        std::string &tag = constraint_tags[field.arg];
+        tag += (tag.empty() ? "at_" : "_at_") + std::to_string(field.offset) + "_eq_" + std::to_string(field.value);
+    }
 
-    return oss.str();
+    return rufus::specialized_name(demangled_name, spec.const_args, spec.function_args, constraint_tags);
 }
 
-void RuFuS::Impl::initialize_target() {
+void JITEngine::initialize_target() {
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
@@ -172,69 +531,272 @@ void RuFuS::Impl::initialize_target() {
 }
 
 void RuFuS::Impl::initialize_pass_managers() {
-    llvm::PassBuilder PB(TM.get());
-    PB.registerModuleAnalyses(MAM);
-    PB.registerCGSCCAnalyses(CGAM);
-    PB.registerFunctionAnalyses(FAM);
-    PB.registerLoopAnalyses(LAM);
-    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    if (PB)
+        return;
+
+    // The registered analyses refer back to the PassBuilder, so it lives as long as the managers
+    PB = std::make_unique<llvm::PassBuilder>(target().TM.get());
+    PB->registerModuleAnalyses(MAM);
+    PB->registerCGSCCAnalyses(CGAM);
+    PB->registerFunctionAnalyses(FAM);
+    PB->registerLoopAnalyses(LAM);
+    PB->crossRegisterProxies(LAM, FAM, CGAM, MAM);
 }
 
-void RuFuS::Impl::initialize_jit() {
-    auto jit_or_err = llvm::orc::LLJITBuilder().create();
+void RuFuS::Impl::clear_analyses() {
+    LAM.clear();
+    FAM.clear();
+    CGAM.clear();
+    MAM.clear();
+}
+
+void JITEngine::initialize_jit() {
+    llvm::orc::LLJITBuilder builder;
+
+    if (const char *env = getenv("RUFUS_HUGE_PAGES")) {
+        huge_pages = std::string(env) == "explicit" ? rufus::SlabMemoryManager::HugePages::Explicit
+                                                    : rufus::SlabMemoryManager::HugePages::Transparent;
+    }
+
+    if (huge_pages) {
+        // Everything lands in one region, so the small code model always reaches
+        auto jtmb_or_err = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (jtmb_or_err) {
+            jtmb_or_err->setRelocationModel(llvm::Reloc::PIC_);
+            jtmb_or_err->setCodeModel(llvm::CodeModel::Small);
+            builder.setJITTargetMachineBuilder(std::move(*jtmb_or_err));
+        } else {
+            llvm::consumeError(jtmb_or_err.takeError());
+        }
+
+        builder.setObjectLinkingLayerCreator(
+            [this](llvm::orc::ExecutionSession &ES,
+                   auto &&...) -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+                auto memory_or_err = rufus::SlabMemoryManager::Create(*huge_pages);
+                if (!memory_or_err)
+                    return memory_or_err.takeError();
+                memory = memory_or_err->get();
+
+                auto ObjLayer = std::make_unique<llvm::orc::ObjectLinkingLayer>(ES, std::move(*memory_or_err));
+
+                // What the default linking layer would have registered
+                auto registrar_or_err = llvm::orc::EPCEHFrameRegistrar::Create(ES);
+                if (!registrar_or_err)
+                    return registrar_or_err.takeError();
+                ObjLayer->addPlugin(
+                    std::make_unique<llvm::orc::EHFrameRegistrationPlugin>(ES, std::move(*registrar_or_err)));
+                return std::move(ObjLayer);
+            });
+    }
+
+    auto jit_or_err = builder.create();
 
     if (!jit_or_err) {
         llvm::errs() << "Failed to create JIT\n";
         return;
     }
+
+    std::lock_guard<std::mutex> lock(mutex);
     JIT = std::move(*jit_or_err);
-    auto &ES = JIT->getExecutionSession();
 
     // Add perf support
-    if (getenv("RUFUS_PERF")) {
-        auto &ObjLayer = llvm::cast<llvm::orc::ObjectLinkingLayer>(JIT->getObjLinkingLayer());
+    if (getenv("RUFUS_PERF"))
+        pending_profiling = RuFuS::ProfilingOptions{};
+    if (pending_profiling)
+        apply_profiling(*pending_profiling);
+
+    // Add C stdlib symbols
+    auto &MainJD = JIT->getMainJITDylib();
+    auto DLSG = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(JIT->getDataLayout().getGlobalPrefix());
+    if (DLSG)
+        MainJD.addGenerator(std::move(*DLSG));
+
+    // Runtime the generated parallel wrappers call into
+    define_host_symbols({{"rufus_parallel_for", llvm::orc::ExecutorAddr::fromPtr(&rufus_parallel_for)},
+                         {"rufus_instrument_record", llvm::orc::ExecutorAddr::fromPtr(&rufus_instrument_record)},
+                         {"rufus_arena_alloc", llvm::orc::ExecutorAddr::fromPtr(&rufus_arena_alloc)},
+                         {"rufus_arena_release", llvm::orc::ExecutorAddr::fromPtr(&rufus_arena_release)},
+                         {"rufus_aos_to_soa", llvm::orc::ExecutorAddr::fromPtr(&rufus_aos_to_soa)},
+                         {"rufus_soa_to_aos", llvm::orc::ExecutorAddr::fromPtr(&rufus_soa_to_aos)}});
+}
+
+void JITEngine::define_host_symbols(llvm::ArrayRef<std::pair<const char *, llvm::orc::ExecutorAddr>> symbols) {
+    auto &ES = JIT->getExecutionSession();
+    llvm::orc::SymbolMap symbol_map;
+    for (const auto &[name, addr] : symbols)
+        symbol_map[ES.intern(JIT->mangle(name))] = {addr,
+                                                    llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable};
+
+    llvm::cantFail(JIT->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(symbol_map))));
+}
+
+void JITEngine::initialize_lazy_support() {
+    if (!JIT)
+        return;
+
+    auto lctm_or_err = llvm::orc::createLocalLazyCallThroughManager(
+        JIT->getTargetTriple(), JIT->getExecutionSession(), llvm::orc::ExecutorAddr::fromPtr(&lazy_compile_failed));
+    if (!lctm_or_err) {
+        llvm::errs() << "Failed to create lazy call-through manager: " << llvm::toString(lctm_or_err.takeError())
+                     << "\n";
+        return;
+    }
+    LCTM = std::move(*lctm_or_err);
+
+    auto ism_builder = llvm::orc::createLocalIndirectStubsManagerBuilder(JIT->getTargetTriple());
+    if (!ism_builder) {
+        llvm::errs() << "No indirect stubs support for " << JIT->getTargetTriple().str() << "\n";
+        return;
+    }
+    ISM = ism_builder();
+}
+
+void JITEngine::enable_profiling(const RuFuS::ProfilingOptions &options) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Frame pointers and line tables are kept from here on
+    profiling = true;
+
+    // Plugins go on with the JIT
+    if (!JIT) {
+        pending_profiling = options;
+        return;
+    }
+    apply_profiling(options);
+}
+
+void JITEngine::enable_huge_pages(rufus::SlabMemoryManager::HugePages kind) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (JIT) {
+        llvm::errs() << "Huge pages must be enabled before the JIT is created\n";
+        return;
+    }
+    huge_pages = kind;
+}
+
+void JITEngine::apply_profiling(const RuFuS::ProfilingOptions &options) {
+    auto &ES = JIT->getExecutionSession();
+    auto &ObjLayer = llvm::cast<llvm::orc::ObjectLinkingLayer>(JIT->getObjLinkingLayer());
+
+    profiling = true;
+
+    if (options.perf_map && !perf_map_enabled) {
+        ObjLayer.addPlugin(std::make_unique<PerfMapPlugin>());
+        perf_map_enabled = true;
+    }
 
+    if (options.jitdump && !jitdump_enabled) {
         // Register perf runtime functions
-        llvm::orc::SymbolMap perf_symbols;
         auto start_addr = llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfStart);
         auto end_addr = llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfEnd);
         auto impl_addr = llvm::orc::ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfImpl);
-
-        perf_symbols[ES.intern(JIT->mangle("llvm_orc_registerJITLoaderPerfStart"))] = {
-            start_addr, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable};
-        perf_symbols[ES.intern(JIT->mangle("llvm_orc_registerJITLoaderPerfEnd"))] = {
-            end_addr, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable};
-        perf_symbols[ES.intern(JIT->mangle("llvm_orc_registerJITLoaderPerfImpl"))] = {
-            impl_addr, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable};
-
-        llvm::cantFail(JIT->getMainJITDylib().define(llvm::orc::absoluteSymbols(perf_symbols)));
+        define_host_symbols({{"llvm_orc_registerJITLoaderPerfStart", start_addr},
+                             {"llvm_orc_registerJITLoaderPerfEnd", end_addr},
+                             {"llvm_orc_registerJITLoaderPerfImpl", impl_addr}});
 
         // Add perf plugin
         ObjLayer.addPlugin(std::make_unique<llvm::orc::PerfSupportPlugin>(ES.getExecutorProcessControl(), start_addr,
-                                                                          end_addr, impl_addr,
-                                                                          false, // EmitDebugInfo
-                                                                          false  // EmitUnwindInfo
-                                                                          ));
+                                                                          end_addr, impl_addr, options.debug_info,
+                                                                          options.unwind_info));
+        jitdump_enabled = true;
+    }
+
+    llvm::outs() << "Perf support enabled (perf map: " << (perf_map_enabled ? "on" : "off")
+                 << ", jitdump: " << (jitdump_enabled ? "on" : "off") << ")\n";
+}
+
+llvm::TargetMachine *RuFuS::Impl::object_target_machine() {
+    if (ObjTM)
+        return ObjTM.get();
 
-        llvm::outs() << "Perf support enabled\n";
+    // Objects we emit ourselves must match what LLJIT would produce: PIC with the small code model, so JITLink can
+    // place them anywhere and route external calls through stubs.
+    auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!JTMB) {
+        llvm::errs() << "Failed to detect host: " << llvm::toString(JTMB.takeError()) << "\n";
+        return nullptr;
     }
+    JTMB->setRelocationModel(llvm::Reloc::PIC_);
+    JTMB->setCodeModel(llvm::CodeModel::Small);
 
-    // Add C stdlib symbols
-    auto &MainJD = JIT->getMainJITDylib();
-    auto DLSG = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(JIT->getDataLayout().getGlobalPrefix());
-    if (DLSG)
-        MainJD.addGenerator(std::move(*DLSG));
+    auto tm_or_err = JTMB->createTargetMachine();
+    if (!tm_or_err) {
+        llvm::errs() << "Failed to create target machine: " << llvm::toString(tm_or_err.takeError()) << "\n";
+        return nullptr;
+    }
+    ObjTM = std::move(*tm_or_err);
+    return ObjTM.get();
 }
 
 void RuFuS::Impl::disable_optimizations() {
-    for (auto &F : M->functions()) {
-        if (!F.isDeclaration()) {
-            F.addFnAttr(llvm::Attribute::OptimizeNone);
-            F.removeFnAttr("min-legal-vector-width");
-            F.addFnAttr("min-legal-vector-width", std::to_string(MaxVectorWidth));
-            F.addFnAttr("prefer-vector-width", std::to_string(MaxVectorWidth));
+    for (auto &F : M->functions())
+        disable_optimizations(F);
+}
+
+void RuFuS::Impl::disable_optimizations(llvm::Function &F) {
+    if (F.isDeclaration())
+        return;
+
+    const unsigned MaxVectorWidth = target().MaxVectorWidth;
+    retarget(F);
+    F.addFnAttr(llvm::Attribute::OptimizeNone);
+    F.removeFnAttr("min-legal-vector-width");
+    F.addFnAttr("min-legal-vector-width", std::to_string(MaxVectorWidth));
+    F.addFnAttr("prefer-vector-width", std::to_string(MaxVectorWidth));
+}
+
+// Links freshly compiled source into M. Whatever M already defines is kept as is, so functions that were already
+// specialized or optimized aren't touched; only what's new gets the load-time treatment.
+bool RuFuS::Impl::link_instantiation(std::unique_ptr<llvm::Module> instance) {
+    if (!M) {
+        M = std::move(instance);
+        disable_optimizations();
+        return true;
+    }
+
+    // Static initializers already ran with the host's copy
+    if (auto *GV = instance->getNamedGlobal("llvm.global_ctors"))
+        GV->eraseFromParent();
+    if (auto *GV = instance->getNamedGlobal("llvm.global_dtors"))
+        GV->eraseFromParent();
+
+    // Definitions the host's IR already has are linked to its copy. Local ones can't be, and get renamed by the linker.
+    for (llvm::Function &F : *instance) {
+        if (F.isDeclaration() || F.hasLocalLinkage())
+            continue;
+        llvm::Function *existing = M->getFunction(F.getName());
+        if (existing && !existing->isDeclaration()) {
+            F.deleteBody();
+            F.setComdat(nullptr);
         }
     }
+    for (llvm::GlobalVariable &GV : instance->globals()) {
+        llvm::GlobalVariable *existing = M->getNamedGlobal(GV.getName());
+        if (GV.isDeclaration() || GV.hasLocalLinkage() || !existing || existing->isDeclaration())
+            continue;
+        GV.setInitializer(nullptr);
+        GV.setLinkage(llvm::GlobalValue::ExternalLinkage);
+        GV.setComdat(nullptr);
+    }
+
+    // Declarations in the host's IR may get their body from the instance
+    llvm::SmallPtrSet<llvm::Function *, 32> host_definitions;
+    for (llvm::Function &F : *M) {
+        if (!F.isDeclaration())
+            host_definitions.insert(&F);
+    }
+
+    if (llvm::Linker::linkModules(*M, std::move(instance))) {
+        llvm::errs() << "Failed to link instantiation\n";
+        return false;
+    }
+
+    for (llvm::Function &F : *M) {
+        if (!F.isDeclaration() && !host_definitions.contains(&F))
+            disable_optimizations(F);
+    }
+    clear_analyses();
+    return true;
 }
 
 llvm::Function *RuFuS::Impl::find_function_by_demangled_name(const std::string &target) {
@@ -331,12 +893,13 @@ void RuFuS::Impl::specialize_internal_variables(llvm::Function *F, const std::ma
     }
 }
 
-llvm::Function *RuFuS::Impl::clone_and_specialize_arguments(llvm::Function *F,
-                                                            const std::map<std::string, int> &const_function_args,
-                                                            const std::string &specialized_name) {
+llvm::Function *RuFuS::Impl::clone_and_specialize_arguments(
+    llvm::Function *F, const std::map<std::string, int> &const_function_args,
+    const std::map<std::string, llvm::Function *> &function_args, const std::string &specialized_name) {
     // Build argument specialization info
     std::set<unsigned> args_to_remove;
     std::map<unsigned, int> arg_values;
+    std::map<unsigned, llvm::Function *> arg_functions;
     unsigned idx = 0;
 
     for (auto &Arg : F->args()) {
@@ -344,6 +907,9 @@ llvm::Function *RuFuS::Impl::clone_and_specialize_arguments(llvm::Function *F,
         if (const_function_args.count(arg_name)) {
             args_to_remove.insert(idx);
             arg_values[idx] = const_function_args.at(arg_name);
+        } else if (function_args.count(arg_name)) {
+            args_to_remove.insert(idx);
+            arg_functions[idx] = function_args.at(arg_name);
         }
         idx++;
     }
@@ -360,7 +926,10 @@ llvm::Function *RuFuS::Impl::clone_and_specialize_arguments(llvm::Function *F,
     idx = 0;
 
     for (auto &old_arg : F->args()) {
-        if (args_to_remove.count(idx)) {
+        if (arg_functions.count(idx)) {
+            // Replace with the bound function itself
+            VMap[&old_arg] = arg_functions[idx];
+        } else if (args_to_remove.count(idx)) {
             // Replace with constant
             VMap[&old_arg] = llvm::ConstantInt::get(old_arg.getType(), arg_values[idx]);
         } else {
@@ -379,11 +948,218 @@ llvm::Function *RuFuS::Impl::clone_and_specialize_arguments(llvm::Function *F,
     return new_func;
 }
 
-void RuFuS::Impl::inline_all_calls(llvm::Function *F) {
+// Makes F check the facts from `build_facts` on entry, after its allocas, and forward the call to `fallback` (same
+// signature) unless all hold. Past the check the facts are assumed, so the optimizer can use them.
+void RuFuS::Impl::guard_entry(
+    llvm::Function *F, llvm::Function *fallback,
+    llvm::function_ref<void(llvm::IRBuilder<> &, llvm::SmallVectorImpl<llvm::Value *> &)> build_facts) {
+    llvm::BasicBlock &entry = F->getEntryBlock();
+    auto split_at = llvm::find_if(entry, [](llvm::Instruction &I) { return !llvm::isa<llvm::AllocaInst>(I); });
+
+    llvm::IRBuilder<> B(&*split_at);
+    llvm::SmallVector<llvm::Value *, 8> facts;
+    build_facts(B, facts);
+    if (facts.empty())
+        return;
+
+    llvm::BasicBlock *body = entry.splitBasicBlock(split_at, "guarded");
+    llvm::BasicBlock *forward = llvm::BasicBlock::Create(F->getContext(), "fallback", F);
+    entry.getTerminator()->eraseFromParent();
+
+    B.SetInsertPoint(&entry);
+    llvm::Value *holds = facts[0];
+    for (llvm::Value *fact : llvm::drop_begin(facts))
+        holds = B.CreateAnd(holds, fact);
+    // Same weights as __builtin_expect
+    B.CreateCondBr(holds, body, forward, llvm::MDBuilder(F->getContext()).createBranchWeights(2000, 1));
+
+    // Kept out of line, so the guarded variant stays as lean as an exact one
+    B.SetInsertPoint(forward);
+    if (llvm::DISubprogram *SP = F->getSubprogram())
+        B.SetCurrentDebugLocation(llvm::DILocation::get(F->getContext(), SP->getLine(), 0, SP));
+    llvm::SmallVector<llvm::Value *, 8> args;
+    for (llvm::Argument &Arg : F->args())
+        args.push_back(&Arg);
+    llvm::CallInst *call = B.CreateCall(fallback, args);
+    call->setCallingConv(fallback->getCallingConv());
+    call->setAttributes(fallback->getAttributes());
+    call->addFnAttr(llvm::Attribute::NoInline);
+    call->addFnAttr(llvm::Attribute::Cold);
+    if (F->getReturnType()->isVoidTy())
+        B.CreateRetVoid();
+    else
+        B.CreateRet(call);
+
+    B.SetInsertPoint(&*body->getFirstInsertionPt());
+    for (llvm::Value *fact : facts)
+        B.CreateAssumption(fact);
+}
+
+void RuFuS::Impl::add_constraints(llvm::Function *F, llvm::Function *fallback,
+                                  const std::map<std::string, RuFuS::Constraint> &constraints) {
+    guard_entry(F, fallback, [&](llvm::IRBuilder<> &B, llvm::SmallVectorImpl<llvm::Value *> &facts) {
+        for (llvm::Argument &Arg : F->args()) {
+            auto it = constraints.find(Arg.getName().str());
+            if (it == constraints.end())
+                continue;
+
+            const RuFuS::Constraint &constraint = it->second;
+            llvm::Type *T = Arg.getType();
+            if (constraint.min)
+                facts.push_back(B.CreateICmpSGE(&Arg, llvm::ConstantInt::get(T, *constraint.min, true)));
+            if (constraint.max)
+                facts.push_back(B.CreateICmpSLE(&Arg, llvm::ConstantInt::get(T, *constraint.max, true)));
+            if (constraint.multiple_of > 1) {
+                // A mask for powers of two, which is also what SCEV recognizes best
+                const std::uint64_t m = constraint.multiple_of;
+                llvm::Value *rem = llvm::isPowerOf2_64(m) ? B.CreateAnd(&Arg, llvm::ConstantInt::get(T, m - 1))
+                                                          : B.CreateSRem(&Arg, llvm::ConstantInt::get(T, m));
+                facts.push_back(B.CreateICmpEQ(rem, llvm::ConstantInt::get(T, 0)));
+            }
+        }
+    });
+}
+
+// Replaces loads of each field with its value, guarded by a check of the field on entry. Fields are usually read in
+// callees (member functions, accessors), so F gets everything inlined first.
+bool RuFuS::Impl::pin_fields(llvm::Function *F, llvm::Function *fallback,
+                             const std::vector<RuFuS::FieldValue> &fields) {
+    promote_allocas(F);
+    inline_all_calls(F);
+    promote_allocas(F);
+
+    auto field_at = [&](llvm::Value *ptr) -> std::optional<std::size_t> {
+        const llvm::DataLayout &DL = M->getDataLayout();
+        std::int64_t offset = 0;
+        auto *base = llvm::dyn_cast<llvm::Argument>(llvm::GetPointerBaseWithConstantOffset(ptr, offset, DL));
+        for (std::size_t i = 0; base && i < fields.size(); ++i) {
+            if (base->getName() == fields[i].arg && offset >= 0 && std::size_t(offset) == fields[i].offset)
+                return i;
+        }
+        return std::nullopt;
+    };
+
+    std::vector<llvm::Type *> field_types(fields.size());
+    llvm::SmallVector<std::pair<llvm::LoadInst *, std::size_t>, 16> pinned;
+    for (llvm::BasicBlock &BB : *F) {
+        for (llvm::Instruction &I : BB) {
+            if (auto *SI = llvm::dyn_cast<llvm::StoreInst>(&I); SI && field_at(SI->getPointerOperand())) {
+                const RuFuS::FieldValue &field = fields[*field_at(SI->getPointerOperand())];
+                llvm::errs() << "Field at offset " << field.offset << " of '" << field.arg << "' is written by "
+                             << F->getName() << "\n";
+                return false;
+            }
+
+            auto *LI = llvm::dyn_cast<llvm::LoadInst>(&I);
+            if (!LI || LI->isVolatile())
+                continue;
+            if (auto i = field_at(LI->getPointerOperand())) {
+                if (!LI->getType()->isIntegerTy() || (field_types[*i] && field_types[*i] != LI->getType())) {
+                    llvm::errs() << "Field at offset " << fields[*i].offset << " of '" << fields[*i].arg
+                                 << "' is not read as one integer type in " << F->getName() << "\n";
+                    return false;
+                }
+                field_types[*i] = LI->getType();
+                pinned.emplace_back(LI, *i);
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        if (!field_types[i]) {
+            llvm::errs() << "No read of the field at offset " << fields[i].offset << " of '" << fields[i].arg
+                         << "' in " << F->getName() << "\n";
+            return false;
+        }
+    }
+
+    for (auto [LI, i] : pinned) {
+        LI->replaceAllUsesWith(llvm::ConstantInt::get(field_types[i], fields[i].value, true));
+        LI->eraseFromParent();
+    }
+
+    guard_entry(F, fallback, [&](llvm::IRBuilder<> &B, llvm::SmallVectorImpl<llvm::Value *> &facts) {
+        for (llvm::Argument &Arg : F->args()) {
+            for (std::size_t i = 0; i < fields.size(); ++i) {
+                if (Arg.getName() != fields[i].arg)
+                    continue;
+                llvm::Value *ptr = B.CreateConstInBoundsGEP1_64(B.getInt8Ty(), &Arg, fields[i].offset);
+                llvm::Value *value = B.CreateLoad(field_types[i], ptr);
+                facts.push_back(B.CreateICmpEQ(value, llvm::ConstantInt::get(field_types[i], fields[i].value, true)));
+            }
+        }
+    });
+    return true;
+}
+
+void RuFuS::Impl::promote_allocas(llvm::Function *F) {
+    llvm::SmallVector<llvm::AllocaInst *, 16> allocas;
+    for (llvm::Instruction &I : F->getEntryBlock()) {
+        if (auto *AI = llvm::dyn_cast<llvm::AllocaInst>(&I); AI && llvm::isAllocaPromotable(AI))
+            allocas.push_back(AI);
+    }
+
+    if (allocas.empty())
+        return;
+
+    llvm::DominatorTree DT(*F);
+    llvm::PromoteMemToReg(allocas, DT);
+}
+
+bool RuFuS::Impl::devirtualize_calls(llvm::Function *F, const llvm::SmallPtrSetImpl<llvm::Function *> &targets) {
+    debug_out << "Devirtualizing calls in function: " << F->getName() << "\n";
+
+    // The bound function usually sits in an -O0 stack slot, and is often forwarded to a helper (e.g. a template
+    // driver) before being called. Promote the slots so the calls become direct, then inline both the helpers that
+    // receive a bound function and the calls to it. Bounded, since the targets may be recursive.
+    constexpr int max_rounds = 8;
+    for (int round = 0; round < max_rounds; ++round) {
+        promote_allocas(F);
+
+        llvm::SmallVector<llvm::CallBase *, 16> calls_to_inline;
+        for (llvm::BasicBlock &BB : *F) {
+            for (llvm::Instruction &I : BB) {
+                auto *CB = llvm::dyn_cast<llvm::CallBase>(&I);
+                if (!CB)
+                    continue;
+
+                // A binding with the wrong signature would become a direct call with mismatched arguments
+                auto *target = llvm::dyn_cast<llvm::Function>(CB->getCalledOperand()->stripPointerCasts());
+                if (targets.contains(target) && CB->getFunctionType() != target->getFunctionType()) {
+                    llvm::errs() << "Bound function " << target->getName() << " does not match the calls through it in "
+                                 << F->getName() << "\n";
+                    return false;
+                }
+
+                llvm::Function *Callee = CB->getCalledFunction();
+                if (!Callee || Callee->isDeclaration() || Callee->isIntrinsic())
+                    continue;
+
+                bool forwards_target = llvm::any_of(CB->args(), [&](llvm::Value *V) {
+                    return targets.contains(llvm::dyn_cast<llvm::Function>(V->stripPointerCasts()));
+                });
+                if (targets.contains(Callee) || forwards_target)
+                    calls_to_inline.push_back(CB);
+            }
+        }
+
+        if (calls_to_inline.empty())
+            return true;
+
+        for (llvm::CallBase *CB : calls_to_inline) {
+            llvm::InlineFunctionInfo IFI;
+            llvm::InlineFunction(*CB, IFI);
+        }
+    }
+    return true;
+}
+
+// Bounded, since calls may be recursive
+void RuFuS::Impl::inline_all_calls(llvm::Function *F, int max_rounds) {
     debug_out << "Inlining calls in function: " << F->getName() << "\n";
 
     bool changed = true;
-    while (changed) {
+    for (int round = 0; changed && round < max_rounds; ++round) {
         changed = false;
         llvm::SmallVector<llvm::CallInst *, 16> calls_to_inline;
 
@@ -391,6 +1167,9 @@ void RuFuS::Impl::inline_all_calls(llvm::Function *F) {
         for (llvm::BasicBlock &BB : *F) {
             for (llvm::Instruction &I : BB) {
                 if (auto *CI = llvm::dyn_cast<llvm::CallInst>(&I)) {
+                    // Calls kept out of line on purpose, e.g. to a guard's fallback
+                    if (CI->getAttributes().hasFnAttr(llvm::Attribute::NoInline))
+                        continue;
                     llvm::Function *Callee = CI->getCalledFunction();
                     if (Callee && !Callee->isDeclaration() && !Callee->isIntrinsic()) {
                         calls_to_inline.push_back(CI);
@@ -412,18 +1191,10 @@ void RuFuS::Impl::inline_all_calls(llvm::Function *F) {
 }
 
 void RuFuS::Impl::optimize_function(llvm::Function *F) {
-    llvm::LoopAnalysisManager LAM;
-    llvm::FunctionAnalysisManager FAM;
-    llvm::CGSCCAnalysisManager CGAM;
-    llvm::ModuleAnalysisManager MAM;
-
-    llvm::PassBuilder PB(TM.get());
+    initialize_pass_managers();
 
-    PB.registerModuleAnalyses(MAM);
-    PB.registerCGSCCAnalyses(CGAM);
-    PB.registerFunctionAnalyses(FAM);
-    PB.registerLoopAnalyses(LAM);
-    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    // F may have been edited outside the pass manager since anything was cached for it
+    FAM.clear(*F, F->getName());
 
     llvm::FunctionPassManager FPM;
 
@@ -444,6 +1215,12 @@ void RuFuS::Impl::optimize_function(llvm::Function *F) {
     LPM.addPass(llvm::LICMPass(LICMOpts));
     FPM.addPass(llvm::createFunctionToLoopPassAdaptor(std::move(LPM), true));
 
+    // Stages of a pipeline driver come one loop after another
+    if (pipeline_drivers.count(F)) {
+        FPM.addPass(llvm::LoopSimplifyPass());
+        FPM.addPass(llvm::LoopFusePass());
+    }
+
     // Vectorization
     FPM.addPass(llvm::LoopVectorizePass());
     FPM.addPass(llvm::SLPVectorizerPass());
@@ -454,12 +1231,24 @@ void RuFuS::Impl::optimize_function(llvm::Function *F) {
     // Propagate constants
     FPM.addPass(llvm::SCCPPass());
 
+    if (rebalance_polynomials)
+        FPM.addPass(rufus::HornerToEstrinPass());
+
     // Cleanup
     FPM.addPass(llvm::InstCombinePass());
     FPM.addPass(llvm::SimplifyCFGPass());
     FPM.addPass(llvm::DCEPass());
 
-    FPM.run(*F, FAM);
+    // Vectorization happens here, so this is where its remarks come from
+    std::unique_ptr<llvm::ToolOutputFile> remarks;
+    if (!dump_dir.empty())
+        remarks = open_remarks(F->getContext(), F->getName().str() + ".function.opt.yaml");
+
+    {
+        std::lock_guard<std::mutex> lock(engine->passes_mutex);
+        FPM.run(*F, FAM);
+    }
+    close_remarks(F->getContext(), std::move(remarks));
     is_optimized[F] = true;
 }
 
@@ -468,15 +1257,53 @@ void RuFuS::Impl::fix_function_attributes(llvm::Function *F) {
     F->removeFnAttr(llvm::Attribute::NoInline);
     F->removeFnAttr(llvm::Attribute::MinSize);
     F->removeFnAttr(llvm::Attribute::OptimizeForSize);
-    F->addFnAttr("target-cpu", CPU);
-    F->addFnAttr("target-features", Features.getString());
+    retarget(*F);
 }
 
-void RuFuS::Impl::strip_loop_metadata(llvm::Function *F) {
+// Whatever CPU the IR was built for, code is generated for the one we run on. Also keeps callees inlinable, since
+// the inliner won't move code into a function with fewer features.
+void RuFuS::Impl::retarget(llvm::Function &F) {
+    F.addFnAttr("target-cpu", target().CPU);
+    F.addFnAttr("target-features", target().Features.getString());
+    F.removeFnAttr("tune-cpu");
+}
+
+// Reads the cycle counter after F's allocas and hands the difference to rufus_instrument_record on every return. The
+// kernel's id slot and name live in the module, so the same code works wherever it ends up loaded.
+void RuFuS::Impl::instrument_function(llvm::Function *F) {
+    llvm::LLVMContext &ctx = M->getContext();
+    llvm::Type *i32_type = llvm::Type::getInt32Ty(ctx);
+    llvm::Type *ptr_type = llvm::PointerType::getUnqual(ctx);
+
+    auto *id = new llvm::GlobalVariable(*M, i32_type, false, llvm::GlobalValue::InternalLinkage,
+                                        llvm::ConstantInt::get(i32_type, 0), "rufus_instrument_id_" + F->getName());
+    llvm::FunctionCallee record = M->getOrInsertFunction(
+        "rufus_instrument_record",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {ptr_type, ptr_type, llvm::Type::getInt64Ty(ctx)}, false));
+
+    llvm::SmallVector<llvm::ReturnInst *, 4> returns;
     for (llvm::BasicBlock &BB : *F) {
-        for (llvm::Instruction &I : BB) {
-            // Find loop backedge branches
-            if (auto *BI = llvm::dyn_cast<llvm::BranchInst>(&I)) {
+        if (auto *RI = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator()))
+            returns.push_back(RI);
+    }
+
+    llvm::BasicBlock &entry = F->getEntryBlock();
+    llvm::IRBuilder<> B(&*llvm::find_if(entry, [](llvm::Instruction &I) { return !llvm::isa<llvm::AllocaInst>(I); }));
+    llvm::Value *name = B.CreateGlobalStringPtr(F->getName(), "rufus_instrument_name_" + F->getName());
+    llvm::Value *start = B.CreateIntrinsic(llvm::Intrinsic::readcyclecounter, {}, {}, nullptr, "start");
+
+    for (llvm::ReturnInst *RI : returns) {
+        B.SetInsertPoint(RI);
+        llvm::Value *end = B.CreateIntrinsic(llvm::Intrinsic::readcyclecounter, {}, {}, nullptr, "end");
+        B.CreateCall(record, {id, name, B.CreateSub(end, start, "cycles")});
+    }
+}
+
+void RuFuS::Impl::strip_loop_metadata(llvm::Function *F) {
+    for (llvm::BasicBlock &BB : *F) {
+        for (llvm::Instruction &I : BB) {
+            // Find loop backedge branches
+            if (auto *BI = llvm::dyn_cast<llvm::BranchInst>(&I)) {
                 llvm::MDNode *LoopMD = BI->getMetadata(llvm::LLVMContext::MD_loop);
                 if (!LoopMD)
                     continue;
@@ -517,13 +1344,17 @@ void RuFuS::Impl::strip_loop_metadata(llvm::Function *F) {
     }
 }
 
-void RuFuS::Impl::optimize_for_jit(llvm::Module *M, llvm::TargetMachine *TM) {
+void RuFuS::Impl::optimize_for_jit(llvm::Module *M, llvm::StringRef name) {
+    const unsigned MaxVectorWidth = target().MaxVectorWidth;
+    const bool profiling = engine->profiling;
     for (auto &F : M->functions()) {
         if (!F.isDeclaration()) {
             F.removeFnAttr(llvm::Attribute::OptimizeNone);
             F.addFnAttr("no-trapping-math", "false");
             F.removeFnAttr(llvm::Attribute::NoInline);
             F.removeFnAttr("frame-pointer");
+            if (profiling)
+                F.addFnAttr("frame-pointer", "all");
             F.removeFnAttr("min-legal-vector-width");
             F.addFnAttr("min-legal-vector-width", std::to_string(MaxVectorWidth));
             F.addFnAttr("prefer-vector-width", std::to_string(MaxVectorWidth));
@@ -532,27 +1363,732 @@ void RuFuS::Impl::optimize_for_jit(llvm::Module *M, llvm::TargetMachine *TM) {
             F.addFnAttr("no-nans-fp-math", "true");
             F.addFnAttr("no-signed-zeros-fp-math", "true");
             F.addFnAttr("unsafe-fp-math", "true");
+            retarget(F);
             mark_lambdas_for_inlining(&F);
         }
     }
 
-    llvm::LoopAnalysisManager LAM;
-    llvm::FunctionAnalysisManager FAM;
-    llvm::CGSCCAnalysisManager CGAM;
-    llvm::ModuleAnalysisManager MAM;
+    initialize_pass_managers();
 
-    llvm::PassBuilder PB(TM);
+    // Run O3 pipeline to normalize the IR
+    if (!jit_pipeline) {
+        jit_pipeline = PB->buildThinLTOPreLinkDefaultPipeline(llvm::OptimizationLevel::O3);
 
-    PB.registerModuleAnalyses(MAM);
-    PB.registerCGSCCAnalyses(CGAM);
-    PB.registerFunctionAnalyses(FAM);
-    PB.registerLoopAnalyses(LAM);
-    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        // Evaluators are only inlined and their loops fully unrolled by now
+        if (rebalance_polynomials)
+            jit_pipeline->addPass(llvm::createModuleToFunctionPassAdaptor(rufus::HornerToEstrinPass()));
+    }
 
-    // Run O3 pipeline to normalize the IR
-    llvm::ModulePassManager MPM = PB.buildThinLTOPreLinkDefaultPipeline(llvm::OptimizationLevel::O3);
+    std::unique_ptr<llvm::ToolOutputFile> remarks;
+    if (!dump_dir.empty())
+        remarks = open_remarks(M->getContext(), name.str() + ".jit.opt.yaml");
+
+    {
+        std::lock_guard<std::mutex> lock(engine->passes_mutex);
+        jit_pipeline->run(*M, MAM);
+    }
+    close_remarks(M->getContext(), std::move(remarks));
+    clear_analyses();
+}
+
+std::string RuFuS::Impl::dump_path(const std::string &file_name) {
+    if (auto EC = llvm::sys::fs::create_directories(dump_dir))
+        llvm::errs() << "Failed to create dump directory " << dump_dir << ": " << EC.message() << "\n";
+
+    llvm::SmallString<256> path(dump_dir);
+    llvm::sys::path::append(path, file_name);
+    return path.str().str();
+}
+
+// Streams every optimization remark raised in `ctx` (passed, missed and analysis) to a YAML file in dump_dir
+std::unique_ptr<llvm::ToolOutputFile> RuFuS::Impl::open_remarks(llvm::LLVMContext &ctx, const std::string &file_name) {
+    auto file_or_err = llvm::setupLLVMOptimizationRemarks(ctx, dump_path(file_name), "", "yaml", false);
+    if (!file_or_err) {
+        llvm::errs() << "Failed to open remarks file: " << llvm::toString(file_or_err.takeError()) << "\n";
+        return nullptr;
+    }
+    return std::move(*file_or_err);
+}
+
+void RuFuS::Impl::close_remarks(llvm::LLVMContext &ctx, std::unique_ptr<llvm::ToolOutputFile> remarks) {
+    if (!remarks)
+        return;
+
+    // The streamers write to the file, so they go first
+    ctx.setLLVMRemarkStreamer(nullptr);
+    ctx.setMainRemarkStreamer(nullptr);
+    remarks->keep();
+}
+
+// Writes the optimized IR that is about to be compiled, and the assembly codegen makes of it, as <name>.ll and
+// <name>.s in dump_dir
+void RuFuS::Impl::dump_module(llvm::Module &module, llvm::StringRef name) {
+    if (dump_dir.empty())
+        return;
+
+    std::error_code EC;
+    {
+        llvm::raw_fd_ostream out(dump_path(name.str() + ".ll"), EC);
+        if (!EC)
+            module.print(out, nullptr);
+    }
+
+    llvm::TargetMachine *OTM = object_target_machine();
+    if (!OTM)
+        return;
+
+    // Codegen consumes the module
+    std::unique_ptr<llvm::Module> clone = llvm::CloneModule(module);
+    clone->setDataLayout(OTM->createDataLayout());
+    clone->setTargetTriple(OTM->getTargetTriple().str());
+
+    llvm::raw_fd_ostream out(dump_path(name.str() + ".s"), EC);
+    if (EC) {
+        llvm::errs() << "Failed to write assembly for " << name << ": " << EC.message() << "\n";
+        return;
+    }
+
+    llvm::legacy::PassManager PM;
+    if (OTM->addPassesToEmitFile(PM, out, nullptr, llvm::CodeGenFileType::AssemblyFile)) {
+        llvm::errs() << "Target can't emit assembly\n";
+        return;
+    }
+    PM.run(*clone);
+    debug_out << "Dumped: " << name << "\n";
+}
+
+std::unique_ptr<llvm::Module> RuFuS::Impl::clone_module(llvm::LLVMContext &ctx) {
+    // Serialize the function and its dependencies to a string
+    std::string module_str;
+    llvm::raw_string_ostream OS(module_str);
+    M->print(OS, nullptr);
+    OS.flush();
+
+    // Parse into the new context
+    llvm::SMDiagnostic Err;
+    auto new_module = llvm::parseIR(llvm::MemoryBufferRef(module_str, "module"), Err, ctx);
+
+    if (!new_module) {
+        llvm::errs() << "Failed to parse module: ";
+        Err.print("rufus", llvm::errs());
+    }
+    return new_module;
+}
+
+void RuFuS::Impl::make_self_contained(llvm::Module &module, llvm::StringRef keep) {
+    // Static initializers are the host program's business, not the kernel's
+    if (auto *GV = module.getNamedGlobal("llvm.global_ctors"))
+        GV->eraseFromParent();
+    if (auto *GV = module.getNamedGlobal("llvm.global_dtors"))
+        GV->eraseFromParent();
+
+    // Only `keep` stays visible, everything else it needs is a private copy. The object then never clashes with, or
+    // depends on, whatever else happens to be in the JIT.
+    llvm::internalizeModule(module, [keep](const llvm::GlobalValue &GV) { return GV.getName() == keep; });
+
+    initialize_pass_managers();
+
+    llvm::ModulePassManager MPM;
+    MPM.addPass(llvm::GlobalDCEPass());
+    MPM.run(module, MAM);
+    clear_analyses();
+}
+
+std::unique_ptr<llvm::MemoryBuffer> RuFuS::Impl::compile_object(llvm::Module &module) {
+    llvm::TargetMachine *OTM = object_target_machine();
+    if (!OTM)
+        return nullptr;
+
+    module.setDataLayout(OTM->createDataLayout());
+    module.setTargetTriple(OTM->getTargetTriple().str());
+
+    llvm::orc::SimpleCompiler compiler(*OTM);
+    auto obj_or_err = compiler(module);
+    if (!obj_or_err) {
+        llvm::errs() << "Codegen failed: " << llvm::toString(obj_or_err.takeError()) << "\n";
+        return nullptr;
+    }
+    return std::move(*obj_or_err);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> RuFuS::Impl::shared_object(llvm::Function *target_func) {
+    // Every process on the node runs the same extraction, so the IR text (and the settings optimize_for_jit()
+    // depends on) identifies the object. Finished objects are loaded without locking. Otherwise the first process to
+    // take the entry's lock compiles it, the rest block on the lock and then load the finished object.
+    const std::string name = target_func->getName().str();
+
+    auto new_ctx = std::make_unique<llvm::LLVMContext>();
+    auto new_module = clone_module(*new_ctx);
+    if (!new_module)
+        return nullptr;
+    make_self_contained(*new_module, name);
+
+    std::string key_str;
+    llvm::raw_string_ostream KS(key_str);
+    new_module->print(KS, nullptr);
+    KS << target().CPU << target().Features.getString();
+    KS << "|profiling=" << engine->profiling << "|estrin=" << rebalance_polynomials;
+    KS.flush();
+    uint64_t key = llvm::xxh3_64bits(llvm::arrayRefFromStringRef(key_str));
+
+    if (auto EC = llvm::sys::fs::create_directories(cache_dir)) {
+        llvm::errs() << "Failed to create cache directory " << cache_dir << ": " << EC.message() << "\n";
+        return nullptr;
+    }
+
+    llvm::SmallString<256> entry(cache_dir);
+    llvm::sys::path::append(entry, name + "." + rufus::host_id() + "." + llvm::utohexstr(key, true));
+    const std::string obj_path = (entry + ".o").str();
+    const std::string lock_path = (entry + ".lock").str();
+
+    // Published atomically, so an object that exists is complete
+    if (auto buf_or_err = llvm::MemoryBuffer::getFile(obj_path)) {
+        debug_out << "Loaded from shared cache: " << obj_path << "\n";
+        return std::move(*buf_or_err);
+    }
+
+    int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        llvm::errs() << "Failed to lock cache entry: " << lock_path << "\n";
+        if (lock_fd >= 0)
+            close(lock_fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> obj;
+    if (auto buf_or_err = llvm::MemoryBuffer::getFile(obj_path)) {
+        obj = std::move(*buf_or_err);
+        debug_out << "Loaded from shared cache: " << obj_path << "\n";
+    } else {
+        optimize_for_jit(new_module.get(), name);
+        if (llvm::verifyModule(*new_module, &llvm::errs())) {
+            llvm::errs() << "Module verification failed\n";
+        } else {
+            dump_module(*new_module, name);
+            obj = compile_object(*new_module);
+        }
+
+        // Publish atomically, readers only ever see complete objects
+        if (obj) {
+            const std::string tmp_path = obj_path + ".tmp." + std::to_string(getpid());
+            std::error_code EC;
+            {
+                llvm::raw_fd_ostream out(tmp_path, EC);
+                if (!EC)
+                    out << obj->getBuffer();
+            }
+            if (EC || llvm::sys::fs::rename(tmp_path, obj_path)) {
+                llvm::errs() << "Failed to write cache entry: " << obj_path << "\n";
+                llvm::sys::fs::remove(tmp_path);
+            } else {
+                debug_out << "Compiled into shared cache: " << obj_path << "\n";
+            }
+        }
+    }
+
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+
+    return obj;
+}
+
+std::uintptr_t RuFuS::Impl::compile_shared(llvm::Function *target_func) {
+    auto obj = shared_object(target_func);
+    if (!obj)
+        return 0;
+
+    llvm::orc::LLJIT *JIT = jit();
+    if (!JIT)
+        return 0;
+
+    if (auto err = JIT->addObjectFile(*JD, std::move(obj))) {
+        llvm::errs() << "JIT Error: " << llvm::toString(std::move(err)) << "\n";
+        return 0;
+    }
+
+    auto sym_or_err = JIT->lookup(*JD, target_func->getName());
+    if (!sym_or_err) {
+        llvm::errs() << "Lookup failed: " << llvm::toString(sym_or_err.takeError()) << "\n";
+        return 0;
+    }
+    return sym_or_err->getValue();
+}
+
+std::optional<llvm::orc::ThreadSafeModule> RuFuS::Impl::self_contained_module(llvm::Function *target_func) {
+    auto new_ctx = std::make_unique<llvm::LLVMContext>();
+    auto new_module = clone_module(*new_ctx);
+    if (!new_module)
+        return std::nullopt;
+
+    make_self_contained(*new_module, target_func->getName());
+    optimize_for_jit(new_module.get(), target_func->getName());
+
+    if (llvm::verifyModule(*new_module, &llvm::errs())) {
+        llvm::errs() << "Module verification failed\n";
+        return std::nullopt;
+    }
+    dump_module(*new_module, target_func->getName());
+    return llvm::orc::ThreadSafeModule(std::move(new_module), std::move(new_ctx));
+}
+
+std::uintptr_t RuFuS::Impl::compile_lazy(llvm::Function *target_func) {
+    llvm::orc::LLJIT *JIT = jit();
+    if (!JIT || !engine->lazy_support())
+        return 0;
+    auto &ES = JIT->getExecutionSession();
+
+    if (!lazy_JD) {
+        auto jd_or_err = JIT->createJITDylib(JD->getName() + ".lazy");
+        if (!jd_or_err) {
+            llvm::errs() << "Failed to create JITDylib: " << llvm::toString(jd_or_err.takeError()) << "\n";
+            return 0;
+        }
+        lazy_JD = &*jd_or_err;
+        lazy_JD->addToLinkOrder(JIT->getMainJITDylib());
+    }
+
+    const std::string name = target_func->getName().str();
+    auto symbol = ES.intern(JIT->mangle(name));
+    auto flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+
+    // Runs on the first call through the stub. The body is self-contained, since by then the rest of the JIT may
+    // look nothing like it does now.
+    auto materializer = [this, name](std::unique_ptr<llvm::orc::MaterializationResponsibility> R) {
+        std::lock_guard<std::recursive_mutex> lock(module_mutex);
+        llvm::orc::LLJIT *JIT = jit();
+
+        llvm::Function *F = M ? M->getFunction(name) : nullptr;
+        if (!F) {
+            llvm::errs() << "Function not found: " << name << "\n";
+            R->failMaterialization();
+            return;
+        }
+
+        debug_out << "Lazily compiling: " << name << "\n";
+        if (!F->hasFnAttribute(llvm::Attribute::OptimizeNone) && !is_optimized[F])
+            optimize_function(F);
+
+        if (!cache_dir.empty()) {
+            if (auto obj = shared_object(F)) {
+                JIT->getObjLinkingLayer().emit(std::move(R), std::move(obj));
+                return;
+            }
+        } else if (auto TSM = self_contained_module(F)) {
+            JIT->getIRCompileLayer().emit(std::move(R), std::move(*TSM));
+            return;
+        }
+        R->failMaterialization();
+    };
+
+    if (auto err = lazy_JD->define(std::make_unique<DeferredMaterializationUnit>(symbol, flags, std::move(materializer)))) {
+        llvm::errs() << "JIT Error: " << llvm::toString(std::move(err)) << "\n";
+        return 0;
+    }
+
+    if (auto err = JD->define(llvm::orc::lazyReexports(*engine->LCTM, *engine->ISM, *lazy_JD,
+                                                       llvm::orc::SymbolAliasMap{{symbol, {symbol, flags}}}))) {
+        llvm::errs() << "JIT Error: " << llvm::toString(std::move(err)) << "\n";
+        return 0;
+    }
+
+    auto sym_or_err = JIT->lookup(*JD, name);
+    if (!sym_or_err) {
+        llvm::errs() << "Lookup failed: " << llvm::toString(sym_or_err.takeError()) << "\n";
+        return 0;
+    }
+    debug_out << "Created lazy stub: " << name << "\n";
+    return sym_or_err->getValue();
+}
+
+// About four chunks per pool thread, rounded up so the specialized chunk loop has no vector remainder
+std::int64_t RuFuS::Impl::parallel_grain(std::int64_t trip_count) {
+    const std::int64_t num_chunks = 4 * rufus::ThreadPool::instance().size();
+    const std::int64_t grain = (trip_count + num_chunks - 1) / num_chunks;
+    return std::min(trip_count, (grain + 15) / 16 * 16);
+}
+
+// Rewrites every access through `base` from records of layout.fields elements to one array of `count` elements per
+// field. Every access must be a whole element at a record index times the record size plus a constant.
+bool RuFuS::Impl::rewrite_to_soa(llvm::Function *F, llvm::Argument *base, const RuFuS::Layout &layout,
+                                 llvm::Value *count) {
+    // The -O0 body hides its accesses behind stack slots and calls
+    inline_all_calls(F);
+    initialize_pass_managers();
+    FAM.clear(*F, F->getName());
+    {
+        llvm::FunctionPassManager FPM;
+        FPM.addPass(llvm::PromotePass());
+        FPM.addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG));
+        FPM.addPass(llvm::InstCombinePass());
+        FPM.addPass(llvm::EarlyCSEPass(true));
+        FPM.addPass(llvm::SimplifyCFGPass());
+
+        std::lock_guard<std::mutex> lock(engine->passes_mutex);
+        FPM.run(*F, FAM);
+    }
+
+    auto fail = [&](const llvm::Twine &reason) {
+        llvm::errs() << "Can't change the layout of '" << base->getName() << "' in " << F->getName() << ": " << reason
+                     << "\n";
+        FAM.clear(*F, F->getName());
+        return false;
+    };
+
+    // Every load and store through base
+    llvm::SmallVector<llvm::Instruction *, 16> accesses;
+    llvm::SmallVector<llvm::Value *, 16> worklist{base};
+    while (!worklist.empty()) {
+        llvm::Value *V = worklist.pop_back_val();
+        for (llvm::User *U : V->users()) {
+            auto *I = llvm::cast<llvm::Instruction>(U);
+            if (llvm::isa<llvm::GetElementPtrInst>(I) || llvm::isa<llvm::BitCastInst>(I))
+                worklist.push_back(I);
+            else if (llvm::getLoadStorePointerOperand(I) == V)
+                accesses.push_back(I);
+            else if (auto *II = llvm::dyn_cast<llvm::IntrinsicInst>(I); !II || !II->isAssumeLikeIntrinsic())
+                return fail("pointer escapes");
+        }
+    }
+
+    // The scratch copy would be dropped
+    auto is_store = [](llvm::Instruction *I) { return llvm::isa<llvm::StoreInst>(I); };
+    if (!layout.write_back && llvm::any_of(accesses, is_store))
+        return fail("written to, but write_back isn't set");
+
+    const std::int64_t element_size = layout.element_size;
+    const std::int64_t record_size = layout.fields * element_size;
+    const llvm::DataLayout &DL = M->getDataLayout();
+    llvm::Type *i64_type = llvm::Type::getInt64Ty(M->getContext());
+
+    llvm::ScalarEvolution &SE = FAM.getResult<llvm::ScalarEvolutionAnalysis>(*F);
+    const llvm::SCEV *base_scev = SE.getSCEV(base);
+    const llvm::SCEV *count_scev = SE.getTruncateOrSignExtend(SE.getSCEV(count), i64_type);
+
+    // Work out every new address before touching anything: field array + record index * element size
+    llvm::SmallVector<std::pair<llvm::Instruction *, const llvm::SCEV *>, 16> rewrites;
+    for (llvm::Instruction *I : accesses) {
+        if (DL.getTypeStoreSize(llvm::getLoadStoreType(I)) != static_cast<std::uint64_t>(element_size))
+            return fail("access isn't a single element");
+
+        const llvm::SCEV *offset = SE.getMinusSCEV(SE.getSCEV(llvm::getLoadStorePointerOperand(I)), base_scev);
+        std::int64_t field_offset = 0;
+        const llvm::SCEV *element = llvm::isa<llvm::SCEVCouldNotCompute>(offset)
+                                        ? nullptr
+                                        : split_records(SE, offset, layout.fields, record_size, field_offset);
+        if (!element || field_offset % element_size)
+            return fail("access isn't a field of a record");
+
+        rewrites.push_back(
+            {I, SE.getAddExpr(element, SE.getMulExpr(SE.getConstant(i64_type, field_offset), count_scev))});
+    }
+
+    llvm::SCEVExpander expander(SE, DL, "soa");
+    for (auto [I, new_offset] : rewrites) {
+        llvm::Value *offset = expander.expandCodeFor(new_offset, i64_type, I);
+        llvm::IRBuilder<> B(I);
+        llvm::Value *ptr = B.CreateGEP(B.getInt8Ty(), base, offset, "soa");
+        if (auto *LI = llvm::dyn_cast<llvm::LoadInst>(I)) {
+            LI->setOperand(LI->getPointerOperandIndex(), ptr);
+            LI->setAlignment(llvm::commonAlignment(LI->getAlign(), element_size));
+        } else {
+            auto *SI = llvm::cast<llvm::StoreInst>(I);
+            SI->setOperand(SI->getPointerOperandIndex(), ptr);
+            SI->setAlignment(llvm::commonAlignment(SI->getAlign(), element_size));
+        }
+    }
+
+    FAM.clear(*F, F->getName());
+    return true;
+}
+
+// wrapper(args) { copies of the layout arguments, transposed into arena scratch; kernel(args); transposed back } with
+// the kernel a copy of `body` rewritten for unit stride
+llvm::Function *RuFuS::Impl::create_layout_wrapper(const std::string &wrapper_name, llvm::Function *body,
+                                                   const std::map<std::string, RuFuS::Layout> &layouts,
+                                                   const std::map<std::string, int> &const_args) {
+    struct Resolved {
+        unsigned index;
+        const RuFuS::Layout *layout;
+        std::optional<std::int64_t> count;
+        unsigned count_index = 0;
+    };
+
+    auto find_arg = [&](llvm::StringRef name) -> llvm::Argument * {
+        auto it = llvm::find_if(body->args(), [&](llvm::Argument &Arg) { return Arg.getName() == name; });
+        return it == body->arg_end() ? nullptr : &*it;
+    };
+
+    std::vector<Resolved> resolved;
+    for (const auto &[name, layout] : layouts) {
+        llvm::Argument *arg = find_arg(name);
+        if (!arg || !arg->getType()->isPointerTy() || !layout.fields || !layout.element_size) {
+            llvm::errs() << "No pointer argument '" << name << "' to change the layout of in: " << body->getName()
+                         << "\n";
+            return nullptr;
+        }
+
+        Resolved r{arg->getArgNo(), &layout};
+        if (auto it = const_args.find(layout.count_arg); it != const_args.end()) {
+            r.count = it->second;
+        } else if (llvm::Argument *count = find_arg(layout.count_arg); count && count->getType()->isIntegerTy()) {
+            r.count_index = count->getArgNo();
+        } else {
+            llvm::errs() << "No record count '" << layout.count_arg << "' in: " << body->getName() << "\n";
+            return nullptr;
+        }
+        resolved.push_back(r);
+    }
+
+    llvm::LLVMContext &ctx = M->getContext();
+    llvm::Type *ptr_type = llvm::PointerType::getUnqual(ctx);
+    llvm::Type *i64_type = llvm::Type::getInt64Ty(ctx);
+    llvm::Type *void_type = llvm::Type::getVoidTy(ctx);
+
+    llvm::ValueToValueMapTy VMap;
+    llvm::Function *kernel = llvm::CloneFunction(body, VMap);
+    kernel->setName("soa_" + wrapper_name);
+    kernel->setLinkage(llvm::GlobalValue::InternalLinkage);
+    for (const Resolved &r : resolved) {
+        llvm::Value *count = kernel->getArg(r.count_index);
+        if (r.count)
+            count = llvm::ConstantInt::get(i64_type, *r.count);
+        if (!rewrite_to_soa(kernel, kernel->getArg(r.index), *r.layout, count)) {
+            kernel->eraseFromParent();
+            return nullptr;
+        }
+    }
+
+    llvm::FunctionCallee arena_alloc =
+        M->getOrInsertFunction("rufus_arena_alloc", llvm::FunctionType::get(ptr_type, {i64_type}, false));
+    llvm::FunctionCallee arena_release =
+        M->getOrInsertFunction("rufus_arena_release", llvm::FunctionType::get(void_type, {ptr_type}, false));
+    llvm::FunctionType *transpose_type =
+        llvm::FunctionType::get(void_type, {ptr_type, ptr_type, i64_type, i64_type, i64_type}, false);
+    llvm::FunctionCallee aos_to_soa = M->getOrInsertFunction("rufus_aos_to_soa", transpose_type);
+    llvm::FunctionCallee soa_to_aos = M->getOrInsertFunction("rufus_soa_to_aos", transpose_type);
+
+    llvm::Function *wrapper =
+        llvm::Function::Create(body->getFunctionType(), llvm::GlobalValue::ExternalLinkage, wrapper_name, M.get());
+    wrapper->addFnAttrs(llvm::AttrBuilder(ctx, body->getAttributes().getFnAttrs()));
+    llvm::SmallVector<llvm::Value *, 8> call_args;
+    for (llvm::Argument &Arg : wrapper->args()) {
+        Arg.setName(body->getArg(Arg.getArgNo())->getName());
+        call_args.push_back(&Arg);
+    }
+
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(ctx, "entry", wrapper));
+    std::vector<llvm::Value *> counts, scratch;
+
+    // Out of scratch: give back what was allocated and run the specialization on the records as they are
+    auto fall_back = [&]() {
+        llvm::IRBuilder<> FB(llvm::BasicBlock::Create(ctx, "no_scratch", wrapper));
+        if (!scratch.empty())
+            FB.CreateCall(arena_release, {scratch.front()});
+        llvm::SmallVector<llvm::Value *, 8> args;
+        for (llvm::Argument &Arg : wrapper->args())
+            args.push_back(&Arg);
+        llvm::CallInst *call = FB.CreateCall(body, args);
+        if (call->getType()->isVoidTy())
+            FB.CreateRetVoid();
+        else
+            FB.CreateRet(call);
+        return FB.GetInsertBlock();
+    };
+
+    for (const Resolved &r : resolved) {
+        llvm::Value *count = r.count ? B.getInt64(*r.count)
+                                     : B.CreateSExtOrTrunc(wrapper->getArg(r.count_index), i64_type, "count");
+        llvm::Value *fields = B.getInt64(r.layout->fields);
+        llvm::Value *element_size = B.getInt64(r.layout->element_size);
+        llvm::Value *soa = B.CreateCall(
+            arena_alloc, {B.CreateMul(count, B.getInt64(r.layout->fields * r.layout->element_size))}, "soa");
+        llvm::BasicBlock *allocated = llvm::BasicBlock::Create(ctx, "allocated", wrapper);
+        B.CreateCondBr(B.CreateIsNotNull(soa), allocated, fall_back(),
+                       llvm::MDBuilder(ctx).createBranchWeights(2000, 1));
+        B.SetInsertPoint(allocated);
+        B.CreateCall(aos_to_soa, {soa, wrapper->getArg(r.index), count, fields, element_size});
+        call_args[r.index] = soa;
+        counts.push_back(count);
+        scratch.push_back(soa);
+    }
+
+    llvm::CallInst *result = B.CreateCall(kernel, call_args);
+    for (std::size_t i = 0; i < resolved.size(); ++i) {
+        const RuFuS::Layout &layout = *resolved[i].layout;
+        if (layout.write_back)
+            B.CreateCall(soa_to_aos, {wrapper->getArg(resolved[i].index), scratch[i], counts[i],
+                                      B.getInt64(layout.fields), B.getInt64(layout.element_size)});
+    }
+
+    // Frees everything allocated after it too
+    B.CreateCall(arena_release, {scratch.front()});
+    if (result->getType()->isVoidTy())
+        B.CreateRetVoid();
+    else
+        B.CreateRet(result);
+    return wrapper;
+}
+
+// driver(args) { stage_0(...); stage_1(...); ... } with every call inlined. Driver arguments are the stages' arguments
+// under their bound names, shared between stages by name.
+llvm::Function *RuFuS::Impl::create_pipeline_driver(const std::string &name,
+                                                    const std::vector<llvm::Function *> &stages,
+                                                    const std::vector<RuFuS::Stage> &stage_specs) {
+    std::vector<std::string> arg_names;
+    std::map<std::string, llvm::Type *> arg_types;
+    std::vector<std::vector<std::string>> stage_args(stages.size());
+
+    for (std::size_t i = 0; i < stages.size(); ++i) {
+        if (!stages[i]->getReturnType()->isVoidTy()) {
+            llvm::errs() << "Pipeline stages must return void: " << stages[i]->getName() << "\n";
+            return nullptr;
+        }
+
+        for (llvm::Argument &Arg : stages[i]->args()) {
+            auto binding = stage_specs[i].bindings.find(Arg.getName().str());
+            const std::string arg_name =
+                binding != stage_specs[i].bindings.end() ? binding->second : Arg.getName().str();
+
+            auto [type_it, inserted] = arg_types.emplace(arg_name, Arg.getType());
+            if (inserted) {
+                arg_names.push_back(arg_name);
+            } else if (type_it->second != Arg.getType()) {
+                llvm::errs() << "Pipeline argument '" << arg_name << "' has a different type in: "
+                             << stages[i]->getName() << "\n";
+                return nullptr;
+            }
+            stage_args[i].push_back(arg_name);
+        }
+    }
+
+    llvm::LLVMContext &ctx = M->getContext();
+    std::vector<llvm::Type *> param_types;
+    for (const std::string &arg_name : arg_names)
+        param_types.push_back(arg_types[arg_name]);
+
+    llvm::Function *driver =
+        llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), param_types, false),
+                               llvm::GlobalValue::ExternalLinkage, name, M.get());
+    std::map<std::string, llvm::Value *> args;
+    for (llvm::Argument &Arg : driver->args()) {
+        Arg.setName(arg_names[Arg.getArgNo()]);
+        args[arg_names[Arg.getArgNo()]] = &Arg;
+    }
+
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(ctx, "entry", driver));
+    for (std::size_t i = 0; i < stages.size(); ++i) {
+        llvm::SmallVector<llvm::Value *, 8> call_args;
+        for (const std::string &arg_name : stage_args[i])
+            call_args.push_back(args[arg_name]);
+        B.CreateCall(stages[i], call_args);
+    }
+    B.CreateRetVoid();
+
+    driver->addFnAttrs(llvm::AttrBuilder(ctx, stages.front()->getAttributes().getFnAttrs()));
+    fix_function_attributes(driver);
+    inline_all_calls(driver);
+    pipeline_drivers.insert(driver);
+    return driver;
+}
+
+// Builds `wrapper_name`, with the signature of `body`, which packs its arguments and hands rufus_parallel_for a chunk
+// function over them. Each chunk offsets the strided pointers by its first index and runs `body` on its share of the
+// range: through the count argument when the trip count is only known at call time, otherwise by calling `body`
+// (specialized to `grain`) or `remainder` (specialized to the short last chunk).
+llvm::Function *RuFuS::Impl::create_parallel_wrapper(const std::string &wrapper_name, llvm::Function *body,
+                                                     llvm::Function *remainder, const RuFuS::ParallelRange &range,
+                                                     std::optional<std::int64_t> trip_count, std::int64_t grain) {
+    if (!body->getReturnType()->isVoidTy()) {
+        llvm::errs() << "Parallel wrapper needs a function returning void: " << body->getName() << "\n";
+        return nullptr;
+    }
+
+    std::optional<unsigned> count_index;
+    std::map<unsigned, std::size_t> strides;
+    for (llvm::Argument &Arg : body->args()) {
+        if (!trip_count && Arg.getName() == range.count_arg && Arg.getType()->isIntegerTy())
+            count_index = Arg.getArgNo();
+
+        auto stride_it = range.strides.find(Arg.getName().str());
+        if (stride_it != range.strides.end() && Arg.getType()->isPointerTy())
+            strides[Arg.getArgNo()] = stride_it->second;
+    }
+
+    if (!trip_count && !count_index) {
+        llvm::errs() << "No integer argument '" << range.count_arg << "' in: " << body->getName() << "\n";
+        return nullptr;
+    }
+    if (strides.size() != range.strides.size()) {
+        llvm::errs() << "Strides must name pointer arguments of: " << body->getName() << "\n";
+        return nullptr;
+    }
+
+    llvm::LLVMContext &ctx = M->getContext();
+    llvm::FunctionType *FT = body->getFunctionType();
+    llvm::StructType *args_type = llvm::StructType::get(ctx, FT->params());
+    llvm::Type *void_type = llvm::Type::getVoidTy(ctx);
+    llvm::Type *ptr_type = llvm::PointerType::getUnqual(ctx);
+    llvm::Type *i64_type = llvm::Type::getInt64Ty(ctx);
+
+    llvm::Function *wrapper = llvm::Function::Create(FT, llvm::GlobalValue::ExternalLinkage, wrapper_name, M.get());
+    llvm::Function *chunk =
+        llvm::Function::Create(llvm::FunctionType::get(void_type, {ptr_type, i64_type, i64_type}, false),
+                               llvm::GlobalValue::InternalLinkage, "chunk_" + wrapper_name, M.get());
+
+    // chunk(args, begin, end)
+    {
+        llvm::IRBuilder<> B(llvm::BasicBlock::Create(ctx, "entry", chunk));
+        llvm::Value *begin = chunk->getArg(1);
+        llvm::Value *count = B.CreateSub(chunk->getArg(2), begin, "count");
+
+        llvm::SmallVector<llvm::Value *, 8> call_args;
+        for (unsigned i = 0; i < FT->getNumParams(); ++i) {
+            llvm::Value *V = B.CreateLoad(FT->getParamType(i), B.CreateStructGEP(args_type, chunk->getArg(0), i));
+            if (auto stride_it = strides.find(i); stride_it != strides.end())
+                V = B.CreateGEP(B.getInt8Ty(), V, B.CreateMul(begin, B.getInt64(stride_it->second)));
+            else if (count_index == i)
+                V = B.CreateSExtOrTrunc(count, FT->getParamType(i));
+            call_args.push_back(V);
+        }
+
+        if (!remainder) {
+            B.CreateCall(body, call_args);
+            B.CreateRetVoid();
+        } else {
+            auto *full_block = llvm::BasicBlock::Create(ctx, "full", chunk);
+            auto *remainder_block = llvm::BasicBlock::Create(ctx, "remainder", chunk);
+            B.CreateCondBr(B.CreateICmpEQ(count, B.getInt64(grain)), full_block, remainder_block);
+            for (auto [block, callee] : {std::pair{full_block, body}, std::pair{remainder_block, remainder}}) {
+                B.SetInsertPoint(block);
+                B.CreateCall(callee, call_args);
+                B.CreateRetVoid();
+            }
+        }
+    }
+
+    // wrapper(...) = rufus_parallel_for(chunk, &args, n, grain)
+    {
+        llvm::IRBuilder<> B(llvm::BasicBlock::Create(ctx, "entry", wrapper));
+        llvm::Value *args = B.CreateAlloca(args_type, nullptr, "args");
+        for (llvm::Argument &Arg : wrapper->args()) {
+            Arg.setName(body->getArg(Arg.getArgNo())->getName());
+            B.CreateStore(&Arg, B.CreateStructGEP(args_type, args, Arg.getArgNo()));
+        }
+
+        llvm::Value *n = trip_count ? B.getInt64(*trip_count)
+                                    : B.CreateSExtOrTrunc(wrapper->getArg(*count_index), i64_type);
+        llvm::FunctionCallee parallel_for = M->getOrInsertFunction(
+            "rufus_parallel_for", llvm::FunctionType::get(void_type, {ptr_type, ptr_type, i64_type, i64_type}, false));
+        B.CreateCall(parallel_for, {chunk, args, n, B.getInt64(grain)});
+        B.CreateRetVoid();
+    }
+
+    fix_function_attributes(chunk);
+    fix_function_attributes(wrapper);
 
-    MPM.run(*M, MAM);
+    debug_out << "Created: " << wrapper_name << " (" << (trip_count ? std::to_string(*trip_count) : "runtime")
+              << " iterations, grain " << (grain ? std::to_string(grain) : "auto") << ")\n";
+    return wrapper;
 }
 
 // ************************************************************************************** \\
@@ -564,7 +2100,9 @@ void RuFuS::Impl::optimize_for_jit(llvm::Module *M, llvm::TargetMachine *TM) {
 //                                                                                        \\
 // ************************************************************************************** \\
 
-RuFuS::RuFuS() : impl(std::make_unique<Impl>()) {}
+RuFuS::RuFuS() : impl(std::make_unique<Impl>(Engine::Private)) {}
+
+RuFuS::RuFuS(Engine engine) : impl(std::make_unique<Impl>(engine)) {}
 
 RuFuS::~RuFuS() = default;
 
@@ -573,6 +2111,10 @@ RuFuS::RuFuS(RuFuS &&) noexcept = default;
 RuFuS &RuFuS::operator=(RuFuS &&) noexcept = default;
 
 RuFuS &RuFuS::load_ir_file(const std::string &ir_file) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    impl->clear_analyses();
+    impl->is_optimized.clear();
+    impl->pipeline_drivers.clear();
     impl->M = llvm::parseIRFile(ir_file, impl->Err, impl->Ctx);
     if (!impl->M) {
         llvm::errs() << "Failed to load IR from: " << ir_file << "\n";
@@ -584,7 +2126,11 @@ RuFuS &RuFuS::load_ir_file(const std::string &ir_file) {
 }
 
 RuFuS &RuFuS::load_ir_string(const std::string &ir_source) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
     auto mem_buf = llvm::MemoryBuffer::getMemBuffer(ir_source);
+    impl->clear_analyses();
+    impl->is_optimized.clear();
+    impl->pipeline_drivers.clear();
     impl->M = llvm::parseIR(mem_buf->getMemBufferRef(), impl->Err, impl->Ctx);
     if (!impl->M) {
         llvm::errs() << "Failed to load IR from string\n";
@@ -595,6 +2141,37 @@ RuFuS &RuFuS::load_ir_string(const std::string &ir_source) {
     return *this;
 }
 
+RuFuS &RuFuS::load_source_string(const std::string &source, const std::vector<std::string> &flags) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    impl->source = source;
+    impl->source_flags = flags;
+    return *this;
+}
+
+RuFuS &RuFuS::instantiate(const std::string &declaration) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+#ifdef RUFUS_HAS_CLANG
+    if (impl->source.empty()) {
+        llvm::errs() << "No source to instantiate " << declaration << " from, see load_source_string\n";
+        return *this;
+    }
+
+    // An explicit instantiation definition appended to the source
+    const std::string source = impl->source + "\ntemplate " + declaration + ";\n";
+    auto instance = rufus::compile_source(source, impl->source_flags, impl->Ctx);
+    if (!instance) {
+        llvm::errs() << "Failed to instantiate: " << declaration << "\n";
+        return *this;
+    }
+
+    if (impl->link_instantiation(std::move(instance)))
+        impl->debug_out << "Instantiated: " << declaration << "\n";
+#else
+    llvm::errs() << "Can't instantiate " << declaration << ": RuFuS was built without RUFUS_ENABLE_CLANG\n";
+#endif
+    return *this;
+}
+
 void RuFuS::Impl::mark_lambdas_for_inlining(llvm::Function *F) {
     for (auto &BB : *F) {
         for (auto &I : BB) {
@@ -622,17 +2199,43 @@ void RuFuS::Impl::mark_lambdas_for_inlining(llvm::Function *F) {
 }
 
 RuFuS &RuFuS::specialize_function(const std::string &demangled_name, const std::map<std::string, int> &const_args) {
+    return specialize_function(demangled_name, Specialization{const_args, {}});
+}
+
+RuFuS &RuFuS::specialize_function(const std::string &demangled_name, const Specialization &spec) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
     llvm::Function *F = impl->find_function_by_demangled_name(demangled_name);
     if (!F) {
         llvm::errs() << "Function not found: " << demangled_name << "\n";
         return *this;
     }
 
+    // Resolve function bindings. These must name pointer arguments.
+    std::map<std::string, llvm::Function *> function_args;
+    llvm::SmallPtrSet<llvm::Function *, 4> bound_functions;
+
+    for (const auto &[name, target_name] : spec.function_args) {
+        auto arg_it = llvm::find_if(F->args(), [&](llvm::Argument &Arg) { return Arg.getName() == name; });
+        if (arg_it == F->arg_end() || !arg_it->getType()->isPointerTy()) {
+            llvm::errs() << "No function pointer argument '" << name << "' in: " << demangled_name << "\n";
+            return *this;
+        }
+
+        llvm::Function *target = impl->find_function_by_demangled_name(target_name);
+        if (!target) {
+            llvm::errs() << "Function not found: " << target_name << "\n";
+            return *this;
+        }
+
+        function_args[name] = target;
+        bound_functions.insert(target);
+    }
+
     // Separate const_args into arguments vs internal variables
     std::map<std::string, int> const_function_args;
     std::map<std::string, int> const_internal_vars;
 
-    for (const auto &[name, value] : const_args) {
+    for (const auto &[name, value] : spec.const_args) {
         bool is_arg = false;
         for (auto &Arg : F->args()) {
             if (Arg.getName() == name) {
@@ -646,10 +2249,85 @@ RuFuS &RuFuS::specialize_function(const std::string &demangled_name, const std::
         }
     }
 
-    const std::string specialized_name = impl->create_specialized_name(demangled_name, const_args);
-    llvm::Function *specialized_func = impl->clone_and_specialize_arguments(F, const_function_args, specialized_name);
+    // Constrained arguments stay arguments, and calls outside the constraints go to the unconstrained variant
+    llvm::Function *fallback = nullptr;
+    if (!spec.constraints.empty()) {
+        for (const auto &[name, constraint] : spec.constraints) {
+            auto arg_it = llvm::find_if(F->args(), [&](llvm::Argument &Arg) { return Arg.getName() == name; });
+            if (arg_it == F->arg_end() || !arg_it->getType()->isIntegerTy() || const_function_args.count(name)) {
+                llvm::errs() << "No unspecialized integer argument '" << name << "' in: " << demangled_name << "\n";
+                return *this;
+            }
+            // Would get its fallback's name
+            if (!constraint.min && !constraint.max && constraint.multiple_of <= 1) {
+                llvm::errs() << "Empty constraint on '" << name << "' in: " << demangled_name << "\n";
+                return *this;
+            }
+            // Would be truncated to the argument's width, and assume something else
+            const unsigned width = arg_it->getType()->getIntegerBitWidth();
+            if ((constraint.min && !llvm::isIntN(width, *constraint.min)) ||
+                (constraint.max && !llvm::isIntN(width, *constraint.max)) || constraint.multiple_of < 0 ||
+                !llvm::isIntN(width, constraint.multiple_of)) {
+                llvm::errs() << "Constraint on '" << name << "' doesn't fit its type in: " << demangled_name << "\n";
+                return *this;
+            }
+        }
+
+        Specialization unconstrained = spec;
+        unconstrained.constraints.clear();
+        const std::string fallback_name = impl->create_specialized_name(demangled_name, unconstrained);
+        if (!impl->M->getFunction(fallback_name))
+            impl->specialize_uninstrumented([&] { specialize_function(demangled_name, unconstrained); });
+        fallback = impl->M->getFunction(fallback_name);
+        if (!fallback)
+            return *this;
+    }
+
+    // Likewise, calls where a pinned field holds something else go to the variant without field values
+    llvm::Function *unpinned_fallback = nullptr;
+    if (!spec.field_values.empty()) {
+        for (const RuFuS::FieldValue &field : spec.field_values) {
+            auto arg_it = llvm::find_if(F->args(), [&](llvm::Argument &Arg) { return Arg.getName() == field.arg; });
+            if (arg_it == F->arg_end() || !arg_it->getType()->isPointerTy() || function_args.count(field.arg)) {
+                llvm::errs() << "No pointer argument '" << field.arg << "' in: " << demangled_name << "\n";
+                return *this;
+            }
+            // The guard reads the field on entry, even where the function would only read it after a null check
+            if (arg_it->getDereferenceableBytes() <= field.offset) {
+                llvm::errs() << "Argument '" << field.arg << "' isn't known to reach offset " << field.offset
+                             << " (only references and `this` are) in: " << demangled_name << "\n";
+                return *this;
+            }
+        }
+
+        Specialization unpinned = spec;
+        unpinned.field_values.clear();
+        const std::string fallback_name = impl->create_specialized_name(demangled_name, unpinned);
+        if (!impl->M->getFunction(fallback_name))
+            impl->specialize_uninstrumented([&] { specialize_function(demangled_name, unpinned); });
+        unpinned_fallback = impl->M->getFunction(fallback_name);
+        if (!unpinned_fallback)
+            return *this;
+    }
+
+    const std::string specialized_name = impl->create_specialized_name(demangled_name, spec);
+    llvm::Function *specialized_func =
+        impl->clone_and_specialize_arguments(F, const_function_args, function_args, specialized_name);
 
     impl->specialize_internal_variables(specialized_func, const_internal_vars);
+    // Before any guard, which then runs ahead of the counter: calls that fail it are left to the fallback
+    if (impl->instrument)
+        impl->instrument_function(specialized_func);
+    if (unpinned_fallback && !impl->pin_fields(specialized_func, unpinned_fallback, spec.field_values)) {
+        specialized_func->eraseFromParent();
+        return *this;
+    }
+    if (fallback)
+        impl->add_constraints(specialized_func, fallback, spec.constraints);
+    if (!bound_functions.empty() && !impl->devirtualize_calls(specialized_func, bound_functions)) {
+        specialized_func->eraseFromParent();
+        return *this;
+    }
     // impl->inline_all_calls(specialized_func);
     impl->strip_loop_metadata(specialized_func);
     impl->fix_function_attributes(specialized_func);
@@ -661,9 +2339,14 @@ RuFuS &RuFuS::specialize_function(const std::string &demangled_name, const std::
 }
 
 RuFuS &RuFuS::optimize() {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
     if (!impl->M)
         return *this;
 
+    // Deferred to the first call of each stub
+    if (impl->lazy)
+        return *this;
+
     for (llvm::Function &F : *impl->M) {
         if (!F.isDeclaration() && !F.hasFnAttribute(llvm::Attribute::OptimizeNone) && !impl->is_optimized[&F]) {
             impl->optimize_function(&F);
@@ -673,13 +2356,82 @@ RuFuS &RuFuS::optimize() {
     return *this;
 }
 
+RuFuS &RuFuS::enable_lazy_compilation() {
+    impl->lazy = true;
+    return *this;
+}
+
+RuFuS &RuFuS::enable_shared_cache(const std::string &cache_dir) {
+    impl->cache_dir = cache_dir;
+    return *this;
+}
+
+RuFuS &RuFuS::enable_polynomial_rebalancing() {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    impl->rebalance_polynomials = true;
+    impl->jit_pipeline.reset();
+    return *this;
+}
+
+RuFuS &RuFuS::enable_instrumentation() {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    impl->instrument = true;
+    return *this;
+}
+
+std::map<std::string, RuFuS::KernelStats> RuFuS::kernel_stats() const {
+    std::map<std::string, KernelStats> stats;
+    for (const auto &[name, counters] : rufus::kernel_counters())
+        stats[name] = {counters.calls, counters.cycles};
+    return stats;
+}
+
+RuFuS &RuFuS::enable_dumps(const std::string &dump_dir) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    impl->dump_dir = dump_dir;
+    return *this;
+}
+
+RuFuS &RuFuS::enable_profiling() { return enable_profiling(ProfilingOptions{}); }
+
+RuFuS &RuFuS::enable_profiling(const ProfilingOptions &options) {
+    impl->engine->enable_profiling(options);
+    return *this;
+}
+
+RuFuS &RuFuS::enable_huge_pages(bool explicit_huge_pages) {
+    impl->engine->enable_huge_pages(explicit_huge_pages ? rufus::SlabMemoryManager::HugePages::Explicit
+                                                        : rufus::SlabMemoryManager::HugePages::Transparent);
+    return *this;
+}
+
+RuFuS::MemoryStats RuFuS::memory_stats() {
+    MemoryStats stats;
+    if (!impl->engine->memory)
+        return stats;
+
+    const auto slab_stats = impl->engine->memory->stats();
+    stats.code_mapped = slab_stats.code.mapped;
+    stats.code_used = slab_stats.code.used;
+    stats.code_huge = slab_stats.code.huge;
+    stats.read_only_mapped = slab_stats.read_only.mapped;
+    stats.read_only_used = slab_stats.read_only.used;
+    stats.read_only_huge = slab_stats.read_only.huge;
+    stats.data_mapped = slab_stats.data.mapped;
+    stats.data_used = slab_stats.data.used;
+    stats.data_huge = slab_stats.data.huge;
+    return stats;
+}
+
 RuFuS &RuFuS::print_module_ir() {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
     if (impl->M)
         impl->M->print(impl->debug_out, nullptr);
     return *this;
 }
 
 RuFuS &RuFuS::print_debug_info() {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
     if (!impl->M) {
         llvm::errs() << "No module loaded\n";
         return *this;
@@ -703,22 +2455,167 @@ RuFuS &RuFuS::print_debug_info() {
         impl->debug_out << "\n";
     }
 
+    if (impl->engine->memory) {
+        const MemoryStats stats = memory_stats();
+        impl->debug_out << "\nJIT memory (used / mapped / on huge pages, bytes): code " << stats.code_used << " / "
+                        << stats.code_mapped << " / " << stats.code_huge << ", read-only " << stats.read_only_used
+                        << " / " << stats.read_only_mapped << " / " << stats.read_only_huge << ", data "
+                        << stats.data_used << " / " << stats.data_mapped << " / " << stats.data_huge << "\n";
+    }
+
     return *this;
 }
 
 std::uintptr_t RuFuS::compile(const std::string &demangled_name, const std::map<std::string, int> &const_args) {
-    std::string specialized_name = impl->create_specialized_name(demangled_name, const_args);
+    return compile(demangled_name, Specialization{const_args, {}});
+}
+
+std::uintptr_t RuFuS::compile(const std::string &demangled_name, const Specialization &spec) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    std::string specialized_name = impl->create_specialized_name(demangled_name, spec);
 
     if (!impl->find_function_by_demangled_name(specialized_name)) {
-        specialize_function(demangled_name, const_args);
+        specialize_function(demangled_name, spec);
     }
 
     return compile(specialized_name);
 }
 
+std::uintptr_t RuFuS::compile_parallel(const std::string &demangled_name, const Specialization &spec,
+                                       const ParallelRange &range) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    const std::string specialized_name = impl->create_specialized_name(demangled_name, spec);
+
+    std::ostringstream oss;
+    oss << "parallel_" << range.count_arg;
+    for (const auto &[name, stride] : range.strides)
+        oss << "_" << name << "_" << stride;
+    if (range.grain > 0)
+        oss << "_grain_" << range.grain;
+    oss << "_" << specialized_name;
+    const std::string wrapper_name = oss.str();
+
+    // The wrapper counts calls, rather than every chunk once per thread
+    auto specialized = [&](const Specialization &variant) -> llvm::Function * {
+        const std::string name = impl->create_specialized_name(demangled_name, variant);
+        if (!impl->M->getFunction(name))
+            impl->specialize_uninstrumented([&] { specialize_function(demangled_name, variant); });
+        return impl->M->getFunction(name);
+    };
+
+    if (!impl->M->getFunction(wrapper_name)) {
+        llvm::Function *wrapper = nullptr;
+        auto count_it = spec.const_args.find(range.count_arg);
+
+        if (count_it == spec.const_args.end()) {
+            // Trip count known at call time: every chunk calls the specialization with its own count. Constraints on
+            // the count hold for the whole range, not for a chunk of it (e.g. the remainder of a multiple_of).
+            Specialization chunk_spec = spec;
+            chunk_spec.constraints.erase(range.count_arg);
+            llvm::Function *body = specialized(chunk_spec);
+            if (body)
+                wrapper = impl->create_parallel_wrapper(wrapper_name, body, nullptr, range, std::nullopt, range.grain);
+            if (!wrapper)
+                return 0;
+        } else {
+            // Trip count fixed: the chunks themselves get specialized to the grain, plus one for the remainder
+            const std::int64_t n = count_it->second;
+            if (n <= 0) {
+                llvm::errs() << "Parallel range '" << range.count_arg << "' is empty in: " << specialized_name << "\n";
+                return 0;
+            }
+            const std::int64_t grain = std::min(n, range.grain > 0 ? range.grain : impl->parallel_grain(n));
+
+            Specialization chunk_spec = spec;
+            chunk_spec.constraints.erase(range.count_arg);
+            chunk_spec.const_args[range.count_arg] = grain;
+            llvm::Function *body = specialized(chunk_spec);
+
+            llvm::Function *remainder = nullptr;
+            if (n % grain) {
+                chunk_spec.const_args[range.count_arg] = n % grain;
+                remainder = specialized(chunk_spec);
+            }
+
+            if (!body || (n % grain && !remainder) ||
+                !(wrapper = impl->create_parallel_wrapper(wrapper_name, body, remainder, range, n, grain)))
+                return 0;
+        }
+
+        if (impl->instrument)
+            impl->instrument_function(wrapper);
+    }
+
+    return compile(wrapper_name);
+}
+
+std::uintptr_t RuFuS::compile_pipeline(const std::string &name, const std::vector<Stage> &stages) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    if (!impl->M)
+        return 0;
+
+    if (!impl->M->getFunction(name)) {
+        if (stages.empty()) {
+            llvm::errs() << "Empty pipeline: " << name << "\n";
+            return 0;
+        }
+
+        std::vector<llvm::Function *> stage_functions;
+        for (const Stage &stage : stages) {
+            const std::string specialized_name = impl->create_specialized_name(stage.function, stage.spec);
+            if (!impl->M->getFunction(specialized_name))
+                specialize_function(stage.function, stage.spec);
+            llvm::Function *F = impl->M->getFunction(specialized_name);
+            if (!F)
+                return 0;
+            stage_functions.push_back(F);
+        }
+
+        llvm::Function *driver = impl->create_pipeline_driver(name, stage_functions, stages);
+        if (!driver)
+            return 0;
+
+        // Fusion only happens in optimize_function, which lazy mode runs on first call
+        if (!impl->lazy)
+            impl->optimize_function(driver);
+    }
+
+    return compile(name);
+}
+
+std::uintptr_t RuFuS::compile_soa(const std::string &demangled_name, const Specialization &spec,
+                                  const std::map<std::string, Layout> &layouts) {
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    if (!impl->M || layouts.empty())
+        return 0;
+    const std::string specialized_name = impl->create_specialized_name(demangled_name, spec);
+
+    std::ostringstream oss;
+    oss << "layout";
+    for (const auto &[name, layout] : layouts)
+        oss << "_" << name << "_" << layout.fields << "x" << layout.element_size << "_by_" << layout.count_arg
+            << (layout.write_back ? "_out" : "");
+    oss << "_" << specialized_name;
+    const std::string wrapper_name = oss.str();
+
+    if (!impl->M->getFunction(wrapper_name)) {
+        if (!impl->M->getFunction(specialized_name))
+            specialize_function(demangled_name, spec);
+        llvm::Function *body = impl->M->getFunction(specialized_name);
+        if (!body || !impl->create_layout_wrapper(wrapper_name, body, layouts, spec.const_args))
+            return 0;
+    }
+
+    return compile(wrapper_name);
+}
+
 std::uintptr_t RuFuS::compile(const std::string &demangled_name) {
-    auto &JD = impl->JIT->getMainJITDylib();
-    auto &ES = impl->JIT->getExecutionSession();
+    std::lock_guard<std::recursive_mutex> lock(impl->module_mutex);
+    llvm::orc::LLJIT *JIT = impl->jit();
+    if (!JIT)
+        return 0;
+    auto &JD = *impl->JD;
+    auto &ES = JIT->getExecutionSession();
 
     llvm::Function *target_func = impl->find_function_by_demangled_name(demangled_name);
     if (!target_func) {
@@ -726,27 +2623,22 @@ std::uintptr_t RuFuS::compile(const std::string &demangled_name) {
         return 0;
     }
 
-    auto sym_or_err = impl->JIT->lookup(target_func->getName());
+    auto sym_or_err = JIT->lookup(JD, target_func->getName());
     if (sym_or_err)
         return sym_or_err->getValue();
     llvm::consumeError(sym_or_err.takeError());
 
-    // Serialize the function and its dependencies to a string
-    std::string module_str;
-    llvm::raw_string_ostream OS(module_str);
-    impl->M->print(OS, nullptr);
-    OS.flush();
+    if (impl->lazy)
+        return impl->compile_lazy(target_func);
 
-    // Parse into a new context
-    auto new_ctx = std::make_unique<llvm::LLVMContext>();
-    llvm::SMDiagnostic Err;
-    auto new_module = llvm::parseIR(llvm::MemoryBufferRef(module_str, "module"), Err, *new_ctx);
+    if (!impl->cache_dir.empty())
+        return impl->compile_shared(target_func);
 
-    if (!new_module) {
-        llvm::errs() << "Failed to parse module: ";
-        Err.print("rufus", llvm::errs());
+    // Copy the function and its dependencies into a new context
+    auto new_ctx = std::make_unique<llvm::LLVMContext>();
+    auto new_module = impl->clone_module(*new_ctx);
+    if (!new_module)
         return 0;
-    }
 
     // Hack to avoid issues with the duplicate $.module.__inits
     if (!impl->first_compile) {
@@ -757,7 +2649,7 @@ std::uintptr_t RuFuS::compile(const std::string &demangled_name) {
     } else
         impl->first_compile = false;
 
-    impl->optimize_for_jit(new_module.get(), impl->TM.get());
+    impl->optimize_for_jit(new_module.get(), target_func->getName());
     for (auto &F : *new_module) {
         if (F.isDeclaration())
             continue;
@@ -793,6 +2685,7 @@ std::uintptr_t RuFuS::compile(const std::string &demangled_name) {
         return 0;
     }
     impl->debug_out << "Module verified successfully\n";
+    impl->dump_module(*new_module, new_func->getName());
 
     // Optimize whole module
     impl->debug_out << "Module optimized for JIT successfully\n";
@@ -800,13 +2693,13 @@ std::uintptr_t RuFuS::compile(const std::string &demangled_name) {
     // Create ThreadSafeModule with new context
     auto TSM = llvm::orc::ThreadSafeModule(std::move(new_module), std::move(new_ctx));
 
-    if (auto err = impl->JIT->addIRModule(std::move(TSM))) {
+    if (auto err = JIT->addIRModule(JD, std::move(TSM))) {
         llvm::errs() << "JIT Error: " << llvm::toString(std::move(err)) << "\n";
         return 0;
     }
     impl->debug_out << "Module added to TSM successfully\n";
 
-    sym_or_err = impl->JIT->lookup(new_func->getName());
+    sym_or_err = JIT->lookup(JD, new_func->getName());
     if (!sym_or_err) {
         llvm::errs() << "Lookup failed - compilation error occurred here\n";
         auto err = sym_or_err.takeError();
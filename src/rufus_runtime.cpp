@@ -0,0 +1,394 @@
+#include <rufus_runtime.hpp>
+
+#include "cache_key.hpp"
+#include "instrument.hpp"
+#include "layout.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+std::uint64_t align_up(std::uint64_t value, std::uint64_t align) { return (value + align - 1) / align * align; }
+
+bool fits_int32(std::int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+std::optional<std::vector<char>> read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return std::nullopt;
+
+    std::vector<char> data(in.tellg());
+    in.seekg(0);
+    if (!in.read(data.data(), data.size()))
+        return std::nullopt;
+    return data;
+}
+
+} // namespace
+
+// Private interface
+struct RuFuSRuntime::Impl {
+    std::string cache_dir;
+    std::map<std::string, std::uintptr_t> symbols;
+    std::map<std::string, std::uintptr_t> loaded;
+
+    std::vector<std::pair<void *, std::size_t>> mappings;
+    std::vector<void *> libraries;
+
+    std::mutex mutex;
+    bool debug;
+
+    Impl(const std::string &dir);
+    ~Impl();
+
+    std::string find_entry(const std::string &symbol_name);
+    std::uintptr_t resolve(const std::string &name);
+    std::uintptr_t load_object(const std::string &path, const std::string &symbol_name);
+    std::uintptr_t load_library(const std::string &path, const std::string &symbol_name);
+};
+
+RuFuSRuntime::Impl::Impl(const std::string &dir) : cache_dir(dir), debug(getenv("RUFUS_DEBUG") != nullptr) {
+    if (cache_dir.empty()) {
+        if (const char *env = getenv("RUFUS_CACHE_DIR"))
+            cache_dir = env;
+    }
+
+    // Runtime the generated parallel wrappers call into
+    symbols["rufus_parallel_for"] = reinterpret_cast<std::uintptr_t>(&rufus_parallel_for);
+    symbols["rufus_instrument_record"] = reinterpret_cast<std::uintptr_t>(&rufus_instrument_record);
+    symbols["rufus_arena_alloc"] = reinterpret_cast<std::uintptr_t>(&rufus_arena_alloc);
+    symbols["rufus_arena_release"] = reinterpret_cast<std::uintptr_t>(&rufus_arena_release);
+    symbols["rufus_aos_to_soa"] = reinterpret_cast<std::uintptr_t>(&rufus_aos_to_soa);
+    symbols["rufus_soa_to_aos"] = reinterpret_cast<std::uintptr_t>(&rufus_soa_to_aos);
+}
+
+RuFuSRuntime::Impl::~Impl() {
+    for (auto [base, size] : mappings)
+        munmap(base, size);
+    for (void *handle : libraries)
+        dlclose(handle);
+}
+
+// The one `<symbol>.<host id>.<ir hash>.{o,so}`. With entries from several builds of the IR around there is no
+// telling which one matches this program, so none is loaded.
+std::string RuFuSRuntime::Impl::find_entry(const std::string &symbol_name) {
+    const std::string prefix = symbol_name + "." + rufus::host_id() + ".";
+
+    std::error_code EC;
+    std::vector<std::filesystem::path> found;
+    for (const auto &entry : std::filesystem::directory_iterator(cache_dir, EC)) {
+        const std::string file_name = entry.path().filename().string();
+        const std::string ext = entry.path().extension().string();
+        if (file_name.compare(0, prefix.size(), prefix) == 0 && (ext == ".o" || ext == ".so"))
+            found.push_back(entry.path());
+    }
+
+    if (found.size() > 1) {
+        std::cerr << "Several cache entries for " << symbol_name << ", remove the stale ones:\n";
+        for (const auto &path : found)
+            std::cerr << "  " << path.string() << "\n";
+        return {};
+    }
+    return found.empty() ? std::string() : found[0].string();
+}
+
+std::uintptr_t RuFuSRuntime::Impl::resolve(const std::string &name) {
+    auto it = symbols.find(name);
+    if (it != symbols.end())
+        return it->second;
+    return reinterpret_cast<std::uintptr_t>(dlsym(RTLD_DEFAULT, name.c_str()));
+}
+
+std::uintptr_t RuFuSRuntime::Impl::load_library(const std::string &path, const std::string &symbol_name) {
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        std::cerr << "Failed to load " << path << ": " << dlerror() << "\n";
+        return 0;
+    }
+    libraries.push_back(handle);
+
+    void *addr = dlsym(handle, symbol_name.c_str());
+    if (!addr)
+        std::cerr << "Symbol " << symbol_name << " not found in: " << path << "\n";
+    return reinterpret_cast<std::uintptr_t>(addr);
+}
+
+// A minimal static linker for the objects compile_shared writes: x86-64, PIC, small code model, no TLS and no static
+// initializers. Code, read-only data and writable data each get their own pages. External calls that don't reach
+// go through stubs next to the code, GOT references through a table next to the read-only data.
+std::uintptr_t RuFuSRuntime::Impl::load_object(const std::string &path, const std::string &symbol_name) {
+    auto fail = [&](const std::string &why) -> std::uintptr_t {
+        std::cerr << "Failed to load " << path << ": " << why << "\n";
+        return 0;
+    };
+
+    auto file = read_file(path);
+    if (!file)
+        return fail("unreadable");
+    const char *data = file->data();
+    const std::size_t size = file->size();
+
+    if (size < sizeof(Elf64_Ehdr))
+        return fail("not an ELF object");
+    const auto *ehdr = reinterpret_cast<const Elf64_Ehdr *>(data);
+    if (std::memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_type != ET_REL || ehdr->e_machine != EM_X86_64)
+        return fail("not an x86-64 relocatable object");
+    if (ehdr->e_shoff + std::uint64_t(ehdr->e_shnum) * sizeof(Elf64_Shdr) > size)
+        return fail("truncated section headers");
+
+    const auto *shdrs = reinterpret_cast<const Elf64_Shdr *>(data + ehdr->e_shoff);
+    const unsigned num_sections = ehdr->e_shnum;
+    for (unsigned i = 0; i < num_sections; ++i) {
+        if (shdrs[i].sh_type != SHT_NOBITS && shdrs[i].sh_offset + shdrs[i].sh_size > size)
+            return fail("truncated section");
+    }
+
+    const Elf64_Shdr *symtab = nullptr;
+    for (unsigned i = 0; i < num_sections; ++i) {
+        if (shdrs[i].sh_type == SHT_SYMTAB)
+            symtab = &shdrs[i];
+    }
+    if (!symtab || symtab->sh_link >= num_sections)
+        return fail("no symbol table");
+    const auto *syms = reinterpret_cast<const Elf64_Sym *>(data + symtab->sh_offset);
+    const std::size_t num_syms = symtab->sh_size / sizeof(Elf64_Sym);
+    const char *strtab = data + shdrs[symtab->sh_link].sh_offset;
+
+    // Layout
+    enum Segment { Text, ReadOnly, Data, NumSegments };
+    std::vector<int> section_segment(num_sections, -1);
+    std::vector<std::uint64_t> section_offset(num_sections, 0);
+    std::uint64_t segment_size[NumSegments] = {};
+
+    for (unsigned i = 0; i < num_sections; ++i) {
+        const Elf64_Shdr &shdr = shdrs[i];
+        if (!(shdr.sh_flags & SHF_ALLOC))
+            continue;
+        if (shdr.sh_flags & SHF_TLS)
+            return fail("thread-local storage is not supported");
+
+        const int segment = (shdr.sh_flags & SHF_EXECINSTR) ? Text : (shdr.sh_flags & SHF_WRITE) ? Data : ReadOnly;
+        segment_size[segment] = align_up(segment_size[segment], std::max<std::uint64_t>(1, shdr.sh_addralign));
+        section_segment[i] = segment;
+        section_offset[i] = segment_size[segment];
+        segment_size[segment] += shdr.sh_size;
+    }
+
+    // One stub and one GOT slot per symbol, used on demand
+    const std::uint64_t stubs_offset = align_up(segment_size[Text], 16);
+    segment_size[Text] = stubs_offset + num_syms * 8;
+    const std::uint64_t got_offset = align_up(segment_size[ReadOnly], 8);
+    segment_size[ReadOnly] = got_offset + num_syms * 8;
+
+    const std::uint64_t page_size = sysconf(_SC_PAGESIZE);
+    std::uint64_t segment_start[NumSegments];
+    std::uint64_t total_size = 0;
+    for (int segment = 0; segment < NumSegments; ++segment) {
+        segment_start[segment] = total_size;
+        total_size += align_up(segment_size[segment], page_size);
+    }
+
+    void *mapping = mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return fail("out of memory");
+    char *base = static_cast<char *>(mapping);
+
+    auto section_addr = [&](unsigned i) {
+        return reinterpret_cast<std::uintptr_t>(base + segment_start[section_segment[i]] + section_offset[i]);
+    };
+
+    for (unsigned i = 0; i < num_sections; ++i) {
+        if (section_segment[i] >= 0 && shdrs[i].sh_type != SHT_NOBITS)
+            std::memcpy(reinterpret_cast<void *>(section_addr(i)), data + shdrs[i].sh_offset, shdrs[i].sh_size);
+    }
+
+    auto unmap_and_fail = [&](const std::string &why) {
+        munmap(mapping, total_size);
+        return fail(why);
+    };
+
+    // Symbols
+    std::vector<std::uintptr_t> sym_addr(num_syms, 0);
+    for (std::size_t k = 1; k < num_syms; ++k) {
+        const Elf64_Sym &sym = syms[k];
+        const char *name = strtab + sym.st_name;
+
+        if (sym.st_shndx == SHN_UNDEF && std::strcmp(name, "_GLOBAL_OFFSET_TABLE_") == 0) {
+            sym_addr[k] = reinterpret_cast<std::uintptr_t>(base + segment_start[ReadOnly] + got_offset);
+        } else if (sym.st_shndx == SHN_UNDEF) {
+            sym_addr[k] = resolve(name);
+            if (!sym_addr[k] && ELF64_ST_BIND(sym.st_info) != STB_WEAK)
+                return unmap_and_fail(std::string("unresolved symbol ") + name);
+        } else if (sym.st_shndx == SHN_ABS) {
+            sym_addr[k] = sym.st_value;
+        } else if (sym.st_shndx == SHN_COMMON) {
+            return unmap_and_fail(std::string("common symbol ") + name + " is not supported");
+        } else if (sym.st_shndx < num_sections && section_segment[sym.st_shndx] >= 0) {
+            sym_addr[k] = section_addr(sym.st_shndx) + sym.st_value;
+        }
+    }
+
+    auto got_slot = [&](std::size_t k) {
+        char *slot = base + segment_start[ReadOnly] + got_offset + k * 8;
+        std::memcpy(slot, &sym_addr[k], 8);
+        return reinterpret_cast<std::uintptr_t>(slot);
+    };
+
+    // jmp *got(%rip)
+    auto stub = [&](std::size_t k) {
+        char *stub = base + segment_start[Text] + stubs_offset + k * 8;
+        const std::int32_t disp = static_cast<std::int32_t>(got_slot(k) - reinterpret_cast<std::uintptr_t>(stub + 6));
+        const unsigned char code[8] = {0xff, 0x25, 0, 0, 0, 0, 0xcc, 0xcc};
+        std::memcpy(stub, code, 8);
+        std::memcpy(stub + 2, &disp, 4);
+        return reinterpret_cast<std::uintptr_t>(stub);
+    };
+
+    // Relocations
+    for (unsigned i = 0; i < num_sections; ++i) {
+        const Elf64_Shdr &shdr = shdrs[i];
+        if (shdr.sh_type != SHT_RELA || shdr.sh_info >= num_sections || section_segment[shdr.sh_info] < 0)
+            continue;
+
+        const auto *relas = reinterpret_cast<const Elf64_Rela *>(data + shdr.sh_offset);
+        for (std::size_t r = 0; r < shdr.sh_size / sizeof(Elf64_Rela); ++r) {
+            const Elf64_Rela &rela = relas[r];
+            const std::size_t k = ELF64_R_SYM(rela.r_info);
+            if (k >= num_syms)
+                return unmap_and_fail("bad relocation symbol");
+
+            const std::uintptr_t P = section_addr(shdr.sh_info) + rela.r_offset;
+            const std::int64_t A = rela.r_addend;
+            const std::uintptr_t S = sym_addr[k];
+
+            auto write32 = [&](std::int64_t value) {
+                const std::int32_t value32 = static_cast<std::int32_t>(value);
+                std::memcpy(reinterpret_cast<void *>(P), &value32, 4);
+            };
+            auto write64 = [&](std::uint64_t value) { std::memcpy(reinterpret_cast<void *>(P), &value, 8); };
+
+            switch (ELF64_R_TYPE(rela.r_info)) {
+            case R_X86_64_NONE:
+                break;
+            case R_X86_64_64:
+                write64(S + A);
+                break;
+            case R_X86_64_PC64:
+                write64(S + A - P);
+                break;
+            case R_X86_64_PC32:
+                if (!fits_int32(S + A - P))
+                    return unmap_and_fail(std::string("PC32 out of range for ") + (strtab + syms[k].st_name));
+                write32(S + A - P);
+                break;
+            case R_X86_64_PLT32:
+                write32((fits_int32(S + A - P) ? S : stub(k)) + A - P);
+                break;
+            case R_X86_64_GOTPCREL:
+            case R_X86_64_GOTPCRELX:
+            case R_X86_64_REX_GOTPCRELX:
+                write32(got_slot(k) + A - P);
+                break;
+            case R_X86_64_32:
+                if (S + A > UINT32_MAX)
+                    return unmap_and_fail("R_X86_64_32 out of range");
+                write32(S + A);
+                break;
+            case R_X86_64_32S:
+                if (!fits_int32(S + A))
+                    return unmap_and_fail("R_X86_64_32S out of range");
+                write32(S + A);
+                break;
+            default:
+                return unmap_and_fail("unsupported relocation type " + std::to_string(ELF64_R_TYPE(rela.r_info)));
+            }
+        }
+    }
+
+    if (segment_size[Text])
+        mprotect(base + segment_start[Text], align_up(segment_size[Text], page_size), PROT_READ | PROT_EXEC);
+    if (segment_size[ReadOnly])
+        mprotect(base + segment_start[ReadOnly], align_up(segment_size[ReadOnly], page_size), PROT_READ);
+    mappings.emplace_back(mapping, total_size);
+
+    for (std::size_t k = 1; k < num_syms; ++k) {
+        if (syms[k].st_shndx != SHN_UNDEF && ELF64_ST_BIND(syms[k].st_info) != STB_LOCAL &&
+            symbol_name == strtab + syms[k].st_name)
+            return sym_addr[k];
+    }
+    return fail("symbol " + symbol_name + " not defined");
+}
+
+// ************************************************************************************** \\
+//  ____  _   _ ____  _     ___ ____   ___ _   _ _____ _____ ____  _____ _    ____ _____  \\
+// |  _ \| | | | __ )| |   |_ _/ ___| |_ _| \ | |_   _| ____|  _ \|  ___/ \  / ___| ____| \\
+// | |_) | | | |  _ \| |    | | |      | ||  \| | | | |  _| | |_) | |_ / _ \| |   |  _|   \\
+// |  __/| |_| | |_) | |___ | | |___   | || |\  | | | | |___|  _ <|  _/ ___ \ |___| |___  \\
+// |_|    \___/|____/|_____|___\____| |___|_| \_| |_| |_____|_| \_\_|/_/   \_\____|_____| \\
+//                                                                                        \\
+// ************************************************************************************** \\
+
+RuFuSRuntime::RuFuSRuntime(const std::string &cache_dir) : impl(std::make_unique<Impl>(cache_dir)) {}
+
+RuFuSRuntime::~RuFuSRuntime() = default;
+
+RuFuSRuntime::RuFuSRuntime(RuFuSRuntime &&) noexcept = default;
+
+RuFuSRuntime &RuFuSRuntime::operator=(RuFuSRuntime &&) noexcept = default;
+
+RuFuSRuntime &RuFuSRuntime::define_symbol(const std::string &name, void *addr) {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    impl->symbols[name] = reinterpret_cast<std::uintptr_t>(addr);
+    return *this;
+}
+
+std::map<std::string, RuFuSRuntime::KernelStats> RuFuSRuntime::kernel_stats() const {
+    std::map<std::string, KernelStats> stats;
+    for (const auto &[name, counters] : rufus::kernel_counters())
+        stats[name] = {counters.calls, counters.cycles};
+    return stats;
+}
+
+std::uintptr_t RuFuSRuntime::load(const std::string &demangled_name, const std::map<std::string, int> &const_args,
+                                  const std::map<std::string, std::string> &function_args) {
+    return load(rufus::specialized_name(demangled_name, const_args, function_args));
+}
+
+std::uintptr_t RuFuSRuntime::load(const std::string &symbol_name) {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    auto it = impl->loaded.find(symbol_name);
+    if (it != impl->loaded.end())
+        return it->second;
+
+    const std::string path = impl->find_entry(symbol_name);
+    if (path.empty()) {
+        if (impl->debug)
+            std::cout << "Not in cache: " << symbol_name << "\n";
+        return 0;
+    }
+
+    const bool is_library = std::filesystem::path(path).extension() == ".so";
+    const std::uintptr_t addr =
+        is_library ? impl->load_library(path, symbol_name) : impl->load_object(path, symbol_name);
+    if (addr) {
+        impl->loaded[symbol_name] = addr;
+        if (impl->debug)
+            std::cout << "Loaded: " << symbol_name << " from " << path << "\n";
+    }
+    return addr;
+}
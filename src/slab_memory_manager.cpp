@@ -0,0 +1,360 @@
+#include "slab_memory_manager.hpp"
+
+#include <llvm/ExecutionEngine/JITLink/JITLink.h>
+#include <llvm/Support/Memory.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace rufus {
+
+namespace {
+
+constexpr std::size_t slab_size = std::size_t(2) << 20;
+
+// Virtual address space set aside per pool. Only what is used gets backed.
+constexpr std::size_t pool_capacity[] = {std::size_t(512) << 20, std::size_t(256) << 20, std::size_t(256) << 20};
+
+llvm::Error make_error(const llvm::Twine &message) {
+    return llvm::make_error<llvm::StringError>(message, llvm::inconvertibleErrorCode());
+}
+
+// Reserves `size` bytes of address space aligned to a slab, so slabs can be huge pages
+char *reserve_aligned(std::size_t size) {
+    void *mem = mmap(nullptr, size + slab_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+
+    char *base = static_cast<char *>(mem);
+    char *aligned = reinterpret_cast<char *>(llvm::alignTo(reinterpret_cast<std::uintptr_t>(base), slab_size));
+    if (aligned != base)
+        munmap(base, aligned - base);
+    munmap(aligned + size, base + slab_size - aligned);
+    return aligned;
+}
+
+// Whether shared memory (memfds, so the code and read-only pools) may get transparent huge pages at all. The selected
+// policy is the bracketed one, e.g. `always within_size advise [never] deny force`.
+bool shmem_thp_allowed() {
+    std::ifstream policy("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+    std::string setting;
+    while (policy >> setting) {
+        if (setting.front() == '[')
+            return setting != "[never]" && setting != "[deny]";
+    }
+    return false;
+}
+
+// Bytes of [begin, end) the kernel backs by huge pages, from /proc/self/smaps
+std::size_t huge_bytes(const char *begin, const char *end) {
+    static constexpr const char *fields[] = {"AnonHugePages:", "ShmemPmdMapped:", "FilePmdMapped:", "Shared_Hugetlb:",
+                                             "Private_Hugetlb:"};
+
+    std::ifstream smaps("/proc/self/smaps");
+    std::size_t total = 0;
+    bool inside = false;
+    std::string line;
+    while (std::getline(smaps, line)) {
+        unsigned long start, stop;
+        if (std::sscanf(line.c_str(), "%lx-%lx ", &start, &stop) == 2) {
+            inside = start >= reinterpret_cast<std::uintptr_t>(begin) && stop <= reinterpret_cast<std::uintptr_t>(end);
+            continue;
+        }
+        if (!inside)
+            continue;
+
+        for (const char *field : fields) {
+            std::size_t kb = 0;
+            const std::size_t length = std::strlen(field);
+            if (line.compare(0, length, field) == 0 && std::sscanf(line.c_str() + length, "%zu", &kb) == 1)
+                total += kb << 10;
+        }
+    }
+    return total;
+}
+
+} // namespace
+
+class SlabMemoryManager::InFlight : public llvm::jitlink::JITLinkMemoryManager::InFlightAlloc {
+  public:
+    InFlight(SlabMemoryManager &MemMgr, llvm::jitlink::LinkGraph &G, std::vector<Piece> standard,
+             std::vector<Piece> finalize)
+        : MemMgr(MemMgr), G(G), standard(std::move(standard)), finalize_only(std::move(finalize)) {}
+
+    void finalize(OnFinalizedFunction OnFinalized) override {
+        // Code is already executable through its own view, it just has to be visible to instruction fetch
+        for (const Piece &piece : standard) {
+            if (piece.pool == Code)
+                llvm::sys::Memory::InvalidateInstructionCache(piece.addr, piece.size);
+        }
+
+        auto dealloc_actions = llvm::orc::shared::runFinalizeActions(G.allocActions());
+        if (!dealloc_actions) {
+            OnFinalized(dealloc_actions.takeError());
+            return;
+        }
+
+        for (const Piece &piece : finalize_only)
+            MemMgr.free_piece(piece);
+
+        auto *allocation = new Allocation{std::move(standard), std::move(*dealloc_actions)};
+        OnFinalized(FinalizedAlloc(llvm::orc::ExecutorAddr::fromPtr(allocation)));
+    }
+
+    void abandon(OnAbandonedFunction OnAbandoned) override {
+        for (const auto *pieces : {&standard, &finalize_only})
+            for (const Piece &piece : *pieces)
+                MemMgr.free_piece(piece);
+        OnAbandoned(llvm::Error::success());
+    }
+
+  private:
+    SlabMemoryManager &MemMgr;
+    llvm::jitlink::LinkGraph &G;
+    std::vector<Piece> standard;
+    std::vector<Piece> finalize_only;
+};
+
+llvm::Expected<std::unique_ptr<SlabMemoryManager>> SlabMemoryManager::Create(HugePages huge_pages) {
+    std::unique_ptr<SlabMemoryManager> MemMgr(new SlabMemoryManager(huge_pages));
+    if (auto err = MemMgr->reserve())
+        return std::move(err);
+    return MemMgr;
+}
+
+llvm::Error SlabMemoryManager::reserve() {
+    const int prots[] = {PROT_READ | PROT_EXEC, PROT_READ, PROT_READ | PROT_WRITE};
+
+    for (std::size_t capacity : pool_capacity)
+        region_size += capacity;
+    working_region_size = pool_capacity[Code] + pool_capacity[ReadOnly];
+
+    region = reserve_aligned(region_size);
+    working_region = reserve_aligned(working_region_size);
+    if (!region || !working_region)
+        return make_error("Failed to reserve JIT memory region");
+
+    std::size_t offset = 0;
+    for (int i = 0; i < NumPools; ++i) {
+        Pool &pool = pools[i];
+        pool.addr = region + offset;
+        pool.working = i == Data ? pool.addr : working_region + offset;
+        pool.capacity = pool_capacity[i];
+        pool.prot = prots[i];
+        offset += pool_capacity[i];
+
+        if (i == Data)
+            continue;
+
+        // Code and read-only data are shared mappings of a memfd, seen once with their final protection and once
+        // writable
+        pool.name = i == Code ? "rufus-code" : "rufus-rodata";
+        if (huge_pages == HugePages::Explicit) {
+            pool.fd = memfd_create(pool.name, MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+            pool.hugetlb = pool.fd >= 0;
+        }
+        if (pool.fd < 0)
+            pool.fd = memfd_create(pool.name, MFD_CLOEXEC);
+        if (pool.fd < 0)
+            return make_error("Failed to create JIT memory file");
+    }
+
+    if (huge_pages == HugePages::Transparent && !shmem_thp_allowed())
+        llvm::errs() << "JIT'd code stays on normal pages: transparent huge pages for it need "
+                        "/sys/kernel/mm/transparent_hugepage/shmem_enabled set to advise or always\n";
+
+    return llvm::Error::success();
+}
+
+SlabMemoryManager::~SlabMemoryManager() {
+    if (region)
+        munmap(region, region_size);
+    if (working_region)
+        munmap(working_region, working_region_size);
+    for (Pool &pool : pools) {
+        if (pool.fd >= 0)
+            close(pool.fd);
+    }
+}
+
+bool SlabMemoryManager::grow(Pool &pool, std::size_t size) {
+    const std::size_t grow_by = llvm::alignTo(size, slab_size);
+    if (pool.mapped + grow_by > pool.capacity)
+        return false;
+
+    char *addr = pool.addr + pool.mapped;
+    char *working = pool.working + pool.mapped;
+
+    if (pool.fd < 0) {
+        if (mmap(addr, grow_by, pool.prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            return false;
+    } else {
+        if (ftruncate(pool.fd, pool.mapped + grow_by) != 0 ||
+            mmap(addr, grow_by, pool.prot, MAP_SHARED | MAP_FIXED, pool.fd, pool.mapped) == MAP_FAILED ||
+            mmap(working, grow_by, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pool.fd, pool.mapped) ==
+                MAP_FAILED) {
+            // No huge pages reserved for us: fall back to normal pages while nothing is in use yet
+            if (!pool.hugetlb || pool.mapped != 0)
+                return false;
+            llvm::errs() << "No hugetlbfs pages reserved (vm.nr_hugepages) for " << pool.name
+                         << ", using normal pages\n";
+            close(pool.fd);
+            pool.fd = memfd_create(pool.name, MFD_CLOEXEC);
+            pool.hugetlb = false;
+            return pool.fd >= 0 && grow(pool, size);
+        }
+    }
+
+    if (huge_pages == HugePages::Transparent) {
+        madvise(addr, grow_by, MADV_HUGEPAGE);
+        if (working != addr)
+            madvise(working, grow_by, MADV_HUGEPAGE);
+    }
+
+    pool.mapped += grow_by;
+    return true;
+}
+
+std::optional<SlabMemoryManager::Piece> SlabMemoryManager::allocate_piece(int pool_index, std::size_t size,
+                                                                         std::size_t align) {
+    Pool &pool = pools[pool_index];
+    size = std::max<std::size_t>(size, 1);
+
+    // First fit among ranges given back by removed code
+    for (auto it = pool.free_ranges.begin(); it != pool.free_ranges.end(); ++it) {
+        const auto [offset, range_size] = *it;
+        const std::size_t start = llvm::alignTo(offset, align);
+        if (start + size > offset + range_size)
+            continue;
+
+        pool.free_ranges.erase(it);
+        if (start > offset)
+            pool.free_ranges[offset] = start - offset;
+        if (start + size < offset + range_size)
+            pool.free_ranges[start + size] = offset + range_size - (start + size);
+
+        pool.used += size;
+        std::memset(pool.working + start, 0, size);
+        return Piece{pool.working + start, pool.addr + start, size, pool_index};
+    }
+
+    const std::size_t start = llvm::alignTo(pool.top, align);
+    if (start + size > pool.mapped && !grow(pool, start + size - pool.mapped))
+        return std::nullopt;
+
+    if (start > pool.top)
+        pool.free_ranges[pool.top] = start - pool.top;
+    pool.top = start + size;
+    pool.used += size;
+    return Piece{pool.working + start, pool.addr + start, size, pool_index};
+}
+
+void SlabMemoryManager::free_piece(const Piece &piece) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Pool &pool = pools[piece.pool];
+    pool.used -= piece.size;
+
+    // Merge with the neighbouring free ranges
+    std::size_t offset = piece.addr - pool.addr;
+    std::size_t size = piece.size;
+
+    auto next = pool.free_ranges.lower_bound(offset);
+    if (next != pool.free_ranges.end() && next->first == offset + size) {
+        size += next->second;
+        next = pool.free_ranges.erase(next);
+    }
+    if (next != pool.free_ranges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            pool.free_ranges.erase(prev);
+        }
+    }
+    pool.free_ranges[offset] = size;
+}
+
+void SlabMemoryManager::allocate(const llvm::jitlink::JITLinkDylib *, llvm::jitlink::LinkGraph &G,
+                                 OnAllocatedFunction OnAllocated) {
+    llvm::jitlink::BasicLayout BL(G);
+
+    std::vector<Piece> standard;
+    std::vector<Piece> finalize;
+    bool exhausted = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &[AG, Seg] : BL.segments()) {
+            const auto prot = llvm::orc::toSysMemoryProtectionFlags(AG.getMemProt());
+            const int pool = (prot & llvm::sys::Memory::MF_EXEC)    ? Code
+                             : (prot & llvm::sys::Memory::MF_WRITE) ? Data
+                                                                    : ReadOnly;
+
+            auto piece = allocate_piece(pool, Seg.ContentSize + Seg.ZeroFillSize, Seg.Alignment.value());
+            if (!piece) {
+                exhausted = true;
+                break;
+            }
+
+            Seg.WorkingMem = piece->working;
+            Seg.Addr = llvm::orc::ExecutorAddr::fromPtr(piece->addr);
+            (AG.getMemLifetime() == llvm::orc::MemLifetime::Standard ? standard : finalize).push_back(*piece);
+        }
+    }
+
+    auto release_all = [&] {
+        for (const auto *pieces : {&standard, &finalize})
+            for (const Piece &piece : *pieces)
+                free_piece(piece);
+    };
+
+    if (exhausted) {
+        release_all();
+        OnAllocated(make_error("JIT memory region exhausted"));
+        return;
+    }
+
+    if (auto err = BL.apply()) {
+        release_all();
+        OnAllocated(std::move(err));
+        return;
+    }
+
+    OnAllocated(std::make_unique<InFlight>(*this, G, std::move(standard), std::move(finalize)));
+}
+
+void SlabMemoryManager::deallocate(std::vector<FinalizedAlloc> Allocs, OnDeallocatedFunction OnDeallocated) {
+    llvm::Error err = llvm::Error::success();
+
+    for (FinalizedAlloc &alloc : Allocs) {
+        auto *allocation = alloc.release().toPtr<Allocation *>();
+        err = llvm::joinErrors(std::move(err), llvm::orc::shared::runDeallocActions(allocation->dealloc_actions));
+        for (const Piece &piece : allocation->pieces)
+            free_piece(piece);
+        delete allocation;
+    }
+
+    OnDeallocated(std::move(err));
+}
+
+SlabMemoryManager::Stats SlabMemoryManager::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats stats;
+    auto usage = [&](const Pool &pool) {
+        const std::size_t huge = huge_pages == HugePages::None ? 0 : huge_bytes(pool.addr, pool.addr + pool.mapped);
+        return Usage{pool.mapped, pool.used, huge};
+    };
+    stats.code = usage(pools[Code]);
+    stats.read_only = usage(pools[ReadOnly]);
+    stats.data = usage(pools[Data]);
+    return stats;
+}
+
+} // namespace rufus
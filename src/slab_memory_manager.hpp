@@ -0,0 +1,93 @@
+#ifndef RUFUS_SLAB_MEMORY_MANAGER_HPP
+#define RUFUS_SLAB_MEMORY_MANAGER_HPP
+
+#include <llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h>
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <optional>
+
+namespace rufus {
+
+// Backs JIT'd code with large slabs instead of a fresh set of pages per linked module. Segments are packed at their
+// own alignment, so consecutive compiles share pages (and, with huge pages, iTLB entries). Code and read-only data
+// are written through a second, writable view of the same memory, so a page can keep growing after code on it runs.
+// All slabs live in one reserved region, keeping the small code model valid.
+class SlabMemoryManager : public llvm::jitlink::JITLinkMemoryManager {
+  public:
+    enum class HugePages { None, Transparent, Explicit };
+
+    struct Usage {
+        std::size_t mapped = 0;
+        std::size_t used = 0;
+        std::size_t huge = 0; // of mapped, backed by huge pages as the kernel reports it
+    };
+
+    struct Stats {
+        Usage code;
+        Usage read_only;
+        Usage data;
+    };
+
+    static llvm::Expected<std::unique_ptr<SlabMemoryManager>> Create(HugePages huge_pages);
+    ~SlabMemoryManager() override;
+
+    void allocate(const llvm::jitlink::JITLinkDylib *JD, llvm::jitlink::LinkGraph &G,
+                  OnAllocatedFunction OnAllocated) override;
+    void deallocate(std::vector<FinalizedAlloc> Allocs, OnDeallocatedFunction OnDeallocated) override;
+
+    Stats stats();
+
+  private:
+    class InFlight;
+
+    struct Piece {
+        char *working;
+        char *addr;
+        std::size_t size;
+        int pool;
+    };
+
+    struct Allocation {
+        std::vector<Piece> pieces;
+        std::vector<llvm::orc::shared::WrapperFunctionCall> dealloc_actions;
+    };
+
+    // One class of memory: bump-allocated, grown a slab at a time, with freed ranges reused first-fit
+    struct Pool {
+        char *addr = nullptr;    // executor view
+        char *working = nullptr; // writable view, same as addr for data
+        std::size_t capacity = 0;
+        int prot = 0;
+        int fd = -1;
+        const char *name = nullptr;
+        bool hugetlb = false;
+
+        std::size_t mapped = 0;
+        std::size_t top = 0;
+        std::size_t used = 0;
+        std::map<std::size_t, std::size_t> free_ranges; // offset -> size
+    };
+
+    enum { Code, ReadOnly, Data, NumPools };
+
+    SlabMemoryManager(HugePages huge_pages) : huge_pages(huge_pages) {}
+
+    llvm::Error reserve();
+    bool grow(Pool &pool, std::size_t size);
+    std::optional<Piece> allocate_piece(int pool_index, std::size_t size, std::size_t align);
+    void free_piece(const Piece &piece);
+
+    HugePages huge_pages;
+    Pool pools[NumPools];
+    char *region = nullptr;
+    std::size_t region_size = 0;
+    char *working_region = nullptr;
+    std::size_t working_region_size = 0;
+    std::mutex mutex;
+};
+
+} // namespace rufus
+
+#endif
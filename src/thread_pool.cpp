@@ -0,0 +1,113 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace rufus {
+
+namespace {
+thread_local bool in_pool_task = false;
+}
+
+ThreadPool &ThreadPool::instance() {
+    static ThreadPool pool([] {
+        if (const char *env = std::getenv("RUFUS_THREADS"))
+            return static_cast<unsigned>(std::max(1, std::atoi(env)));
+        return std::max(1u, std::thread::hardware_concurrency());
+    }());
+    return pool;
+}
+
+ThreadPool::ThreadPool(unsigned num_threads) : blocks(std::make_unique<Block[]>(std::max(1u, num_threads))) {
+    for (unsigned i = 1; i < num_threads; ++i)
+        workers.emplace_back([this, i] { worker_loop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::parallel_for(std::int64_t n, std::int64_t grain, Body body, void *ctx) {
+    if (n <= 0)
+        return;
+
+    const std::int64_t participants = size();
+    if (grain <= 0)
+        grain = std::max<std::int64_t>(1, (n + 4 * participants - 1) / (4 * participants));
+    const std::int64_t num_chunks = (n + grain - 1) / grain;
+
+    std::unique_lock<std::mutex> job_lock(job_mutex, std::defer_lock);
+    if (workers.empty() || num_chunks == 1 || in_pool_task || !job_lock.try_lock()) {
+        for (std::int64_t begin = 0; begin < n; begin += grain)
+            body(ctx, begin, std::min(n, begin + grain));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->body = body;
+        this->ctx = ctx;
+        this->n = n;
+        this->grain = grain;
+        for (std::int64_t p = 0; p < participants; ++p) {
+            blocks[p].next.store(num_chunks * p / participants, std::memory_order_relaxed);
+            blocks[p].end = num_chunks * (p + 1) / participants;
+        }
+        pending = static_cast<unsigned>(workers.size());
+        ++generation;
+    }
+    wake.notify_all();
+
+    run_chunks(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending == 0; });
+}
+
+void ThreadPool::worker_loop(unsigned participant) {
+    std::uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+        }
+
+        run_chunks(participant);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0)
+            done.notify_one();
+    }
+}
+
+void ThreadPool::run_chunks(unsigned participant) {
+    in_pool_task = true;
+
+    // Own block first, then steal from the others in turn
+    const unsigned participants = size();
+    for (unsigned k = 0; k < participants; ++k) {
+        Block &block = blocks[(participant + k) % participants];
+        for (std::int64_t chunk = block.next.fetch_add(1, std::memory_order_relaxed); chunk < block.end;
+             chunk = block.next.fetch_add(1, std::memory_order_relaxed)) {
+            const std::int64_t begin = chunk * grain;
+            body(ctx, begin, std::min(n, begin + grain));
+        }
+    }
+
+    in_pool_task = false;
+}
+
+} // namespace rufus
+
+extern "C" void rufus_parallel_for(rufus::ThreadPool::Body body, void *ctx, std::int64_t n, std::int64_t grain) {
+    rufus::ThreadPool::instance().parallel_for(n, grain, body, ctx);
+}
@@ -0,0 +1,70 @@
+#ifndef RUFUS_THREAD_POOL_HPP
+#define RUFUS_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rufus {
+
+// Process-wide pool that runs the parallel wrappers RuFuS JITs around specialized kernels. The calling thread takes
+// part in every job. Chunks are dealt out as one contiguous block per thread for locality, and a thread that runs out
+// steals chunks from the others' blocks.
+class ThreadPool {
+  public:
+    using Body = void (*)(void *ctx, std::int64_t begin, std::int64_t end);
+
+    // Sized by RUFUS_THREADS, or the hardware concurrency
+    static ThreadPool &instance();
+
+    explicit ThreadPool(unsigned num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+    // Calls body on [0, n) in chunks of `grain` indices (the last one may be short). grain <= 0 picks one from n and
+    // the pool size. Nested calls, and calls while another thread's job is running, run serially on the caller.
+    void parallel_for(std::int64_t n, std::int64_t grain, Body body, void *ctx);
+
+  private:
+    struct alignas(64) Block {
+        std::atomic<std::int64_t> next{0};
+        std::int64_t end = 0;
+    };
+
+    void worker_loop(unsigned participant);
+    void run_chunks(unsigned participant);
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Block[]> blocks;
+
+    // Current job, published under `mutex`
+    Body body = nullptr;
+    void *ctx = nullptr;
+    std::int64_t n = 0;
+    std::int64_t grain = 1;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::uint64_t generation = 0;
+    unsigned pending = 0;
+    bool stop = false;
+
+    // One job at a time
+    std::mutex job_mutex;
+};
+
+} // namespace rufus
+
+// Entry point for JIT'd parallel wrappers
+extern "C" void rufus_parallel_for(rufus::ThreadPool::Body body, void *ctx, std::int64_t n, std::int64_t grain);
+
+#endif